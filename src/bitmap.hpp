@@ -66,8 +66,15 @@ public:
      */
     uint32_t nextBit(uint32_t pos = 0, bool value = false) const
     {
+        const uint8_t _full = value ? 0x00 : 0xff;
         while (pos < _sizeInBits)
         {
+            // skip a whole byte at once when it has no such bit
+            if (pos % BYTEINBITS == 0 and _data[_whichByte(pos)] == _full)
+            {
+                pos += BYTEINBITS;
+                continue;
+            }
             if (get(pos) == value)
                 return pos;
             pos++;
@@ -75,11 +82,45 @@ public:
         return -1;
     }
 
+    /**
+     * @brief get the length of the run of (bit == value) starting at pos
+     *
+     * @param pos start position inclusive
+     * @param value
+     * @return number of consecutive bits equal to value, 0 if get(pos) != value
+     */
+    uint32_t runLength(uint32_t pos, bool value = false) const
+    {
+        const uint8_t _full = value ? 0xff : 0x00;
+        uint32_t start = pos;
+        while (pos < _sizeInBits)
+        {
+            // skip a whole byte at once when it is all value
+            if (pos % BYTEINBITS == 0 and pos + BYTEINBITS <= _sizeInBits and _data[_whichByte(pos)] == _full)
+            {
+                pos += BYTEINBITS;
+                continue;
+            }
+            if (get(pos) != value)
+                break;
+            pos++;
+        }
+        return pos - start;
+    }
+
     uint32_t count(uint32_t p = 0, bool value = true) const
     {
         uint32_t cnt = 0;
         while (p < _sizeInBits)
         {
+            // whole bytes at once
+            if (p % BYTEINBITS == 0 and p + BYTEINBITS <= _sizeInBits)
+            {
+                auto ones = __builtin_popcount(_data[_whichByte(p)]);
+                cnt += value ? ones : BYTEINBITS - ones;
+                p += BYTEINBITS;
+                continue;
+            }
             if (get(p) == value)
                 cnt++;
             p++;
@@ -126,6 +167,28 @@ public:
         _data[_whichByte(pos)] &= (~_getMask(pos));
     }
 
+    /**
+     * @brief reset the bits [pos, pos + len), whole bytes at once.
+     *
+     * @param pos
+     * @param len
+     */
+    void resetRange(unsigned pos, unsigned len)
+    {
+        assert(pos + len <= _sizeInBytes * BYTEINBITS);
+        unsigned end = pos + len;
+        while (pos < end and pos % BYTEINBITS != 0)
+            reset(pos++);
+        if (end - pos >= BYTEINBITS)
+        {
+            unsigned bytes = (end - pos) / BYTEINBITS;
+            memset(_data + _whichByte(pos), 0, bytes);
+            pos += bytes * BYTEINBITS;
+        }
+        while (pos < end)
+            reset(pos++);
+    }
+
     void resetAll()
     {
         memset(_data, 0, _sizeInBytes);
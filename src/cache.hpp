@@ -18,11 +18,13 @@ private:
         uint8_t data[BLOCK_SIZE];
         size_t block_idx;
         bool dirty;
+        unsigned pins; // a pinned block is not evicted, see pin()
         cache_item()
         {
             memset(data, 0, BLOCK_SIZE);
             block_idx = (size_t)-1;
             dirty = false;
+            pins = 0;
         }
     };
     void _write_item_back(cache_item &item)
@@ -58,10 +60,16 @@ private:
 
     void _free_lru()
     {
-        assert(!_lru_list.empty());
-        auto pos = _lru_list.back();
+        // the least recently used block that is not pinned
+        auto it = _lru_list.end();
+        do
+        {
+            assert(it != _lru_list.begin());
+            --it;
+        } while (_cache[*it].pins > 0);
+        auto pos = *it;
         cache_item &item = _cache[pos];
-        _lru_list.pop_back();
+        _lru_list.erase(it);
         _lru_map.erase(item.block_idx);
         _write_item_back(item);
         item.block_idx = -1;
@@ -129,6 +137,34 @@ public:
         memcpy(buf, _cache[pos].data, BLOCK_SIZE);
         _update(it->second);
     }
+    /**
+     * @brief Pin a block in the cache and get its cached data, e.g. to read it in place without copying it out.
+     * The block is not evicted, and the pointer stays valid, until it is unpinned. Writes to the block are seen through it.
+     *
+     * @param block_index
+     * @return const uint8_t* the cached data
+     */
+    const uint8_t *pin(unsigned block_index)
+    {
+        assert(block_index < DISK_SIZE / BLOCK_SIZE);
+        if (_lru_map.count(block_index) == 0)
+            _get_block_from_disk(block_index);
+        auto it = _lru_map.find(block_index);
+        auto pos = *(it->second);
+        _cache[pos].pins++;
+        _update(it->second);
+        return _cache[pos].data;
+    }
+
+    void unpin(unsigned block_index)
+    {
+        auto it = _lru_map.find(block_index);
+        assert(it != _lru_map.end());
+        auto &&item = _cache[*(it->second)];
+        assert(item.pins > 0);
+        item.pins--;
+    }
+
     void write_block(unsigned block_index, const void *buf)
     {
         // _disk.write_block(block_index, buf);
@@ -17,4 +17,31 @@
 constexpr auto DISK_SIZE = 64 * MB + 3 * KB;
 constexpr auto BLOCK_SIZE = 1 * KB;
 
+// Dirty file data held for delayed allocation before a writeback is forced
+constexpr auto DELAYED_ALLOC_LIMIT = 4 * MB;
+
+// Extents (logical start, physical start, length) kept in memory for the block maps of recently used files
+constexpr auto EXTENT_CACHE_CAPACITY = 64 * 1024;
+
+// Decoded inodes kept in memory, the dirty ones are written back at sync
+constexpr auto INODE_CACHE_CAPACITY = 4096;
+
+// Names looked up in directories kept in memory, including the names found missing
+constexpr auto DENTRY_CACHE_CAPACITY = 16 * 1024;
+
+// Linear directories whose per block free slot sizes are kept in memory for the inserts
+constexpr auto DIR_HINTS_CAPACITY = 1024;
+
+// Entries freed in a directory before sync compacts it
+constexpr auto DIR_COMPACT_FREES = 32;
+
+// Timestamps updated lazily (lazytime) are written at sync once older than this, in seconds
+constexpr auto LAZYTIME_MAX_AGE = 24 * 60 * 60;
+
+// Names one bulk create (VFS::create_many()) may take, more than the inodes of an image
+constexpr auto CREATE_MANY_MAX = 64 * 1024;
+
+// Format new images with extent mapped inodes (ext4 like extent trees in i_block) instead of indirect blocks
+constexpr bool FORMAT_WITH_EXTENTS = false;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,113 @@
+#ifndef __DENTRYCACHE_H__
+#define __DENTRYCACHE_H__
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * @brief Name lookups of the recently used directories : (directory inode, name) -> inode. A negative entry records that a name
+ * does not exist, so looking up a missing file twice does not scan the directory twice either. The owner updates the entries
+ * as it adds and frees directory entries, the least recently used ones are dropped once the cache is full.
+ */
+class DentryCache
+{
+    const size_t _capacity;
+    size_t _size = 0;
+
+    std::list<std::pair<uint32_t /*dir inode*/, std::string>> _lru_list; // Most Recently Used List , the back one is LRU.
+    struct item
+    {
+        uint32_t inode; // negative if the name does not exist
+        decltype(_lru_list.begin()) lru;
+    };
+    std::unordered_map<uint32_t, std::unordered_map<std::string, item>> _dirs;
+    std::string _key; // reused by find(), so a lookup does not allocate once it is large enough
+
+public:
+    static constexpr uint32_t negative = 0;
+
+    DentryCache(size_t capacity) : _capacity(capacity) {}
+
+    /**
+     * @brief Look a name up and mark it as recently used.
+     *
+     * @param dir the directory inode
+     * @param name not null terminated
+     * @param len
+     * @param inode set to the inode of the name, or negative
+     * @return true if the name is cached.
+     */
+    bool find(uint32_t dir, const char *name, size_t len, uint32_t &inode)
+    {
+        auto d = _dirs.find(dir);
+        if (d == _dirs.end())
+            return false;
+        _key.assign(name, len);
+        auto it = d->second.find(_key);
+        if (it == d->second.end())
+            return false;
+        _lru_list.splice(_lru_list.begin(), _lru_list, it->second.lru);
+        inode = it->second.inode;
+        return true;
+    }
+
+    /**
+     * @brief Cache a name, or update the cached one.
+     *
+     * @param dir the directory inode
+     * @param name
+     * @param inode the inode of the name, or negative
+     */
+    void insert(uint32_t dir, const std::string &name, uint32_t inode)
+    {
+        auto &&names = _dirs[dir];
+        auto it = names.find(name);
+        if (it == names.end())
+        {
+            _lru_list.emplace_front(dir, name);
+            it = names.emplace(name, item()).first;
+            it->second.lru = _lru_list.begin();
+            _size++;
+        }
+        else
+            _lru_list.splice(_lru_list.begin(), _lru_list, it->second.lru);
+        it->second.inode = inode;
+        while (_size > _capacity)
+        {
+            auto &&lru = _lru_list.back();
+            auto d = _dirs.find(lru.first);
+            d->second.erase(lru.second);
+            if (d->second.empty())
+                _dirs.erase(d);
+            _lru_list.pop_back();
+            _size--;
+        }
+    }
+
+    /**
+     * @brief Drop all names of a directory, e.g. when it is removed and its inode may be reused.
+     *
+     * @param dir
+     */
+    void erase_dir(uint32_t dir)
+    {
+        auto d = _dirs.find(dir);
+        if (d == _dirs.end())
+            return;
+        for (auto &&i : d->second)
+            _lru_list.erase(i.second.lru);
+        _size -= d->second.size();
+        _dirs.erase(d);
+    }
+
+    void clear()
+    {
+        _dirs.clear();
+        _lru_list.clear();
+        _size = 0;
+    }
+};
+
+#endif
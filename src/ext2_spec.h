@@ -41,6 +41,41 @@ using __u32 = uint32_t;
 #define EXT2_OS_FREEBSD 0x03
 #define EXT2_OS_LITES 0x04
 
+#define EXT2_FEATURE_COMPAT_DIR_PREALLOC 0x0001
+// directories outgrowing a block are indexed by a hash tree, see EXT2_INDEX_FL
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+// group descriptors carry EXT2M_BG_* flags
+#define EXT2M_FEATURE_RO_COMPAT_UNINIT_BG 0x0010
+
+// bg_flags : the group's inode bitmap / block bitmap was never written, its inode table was not zeroed
+#define EXT2M_BG_INODE_UNINIT 0x0001
+#define EXT2M_BG_BLOCK_UNINIT 0x0002
+#define EXT2M_BG_INODE_UNZEROED 0x0004
+
+// new inodes map their blocks with an extent tree
+#define EXT2M_FEATURE_INCOMPAT_EXTENTS 0x0040
+
+// i_flags : i_block holds the root of an extent tree instead of block pointers
+#define EXT2M_EXTENTS_FL 0x00080000
+
+// files up to sizeof(i_block) bytes may keep their data in i_block
+#define EXT2M_FEATURE_INCOMPAT_INLINE_DATA 0x8000
+
+// i_flags : i_block holds the file data, the inode has no block
+#define EXT2M_INLINE_DATA_FL 0x10000000
+
+// i_flags : the mapped blocks from logical block osd1 (the written mark) on were preallocated and never written, they read as
+// zeros
+#define EXT2M_UNWRITTEN_FL 0x00400000
+
+// i_flags : the directory is indexed by a hash tree (htree)
+#define EXT2_INDEX_FL 0x00001000
+
+// s_def_hash_version, dx_root_info.hash_version
+#define EXT2_DX_HASH_LEGACY 0
+#define EXT2_DX_HASH_TEA 2
+#define EXT2_HTREE_EOF 0x7fffffffu
+
 #define EXT2_DEF_RESUID 0x0000
 #define EXT2_DEF_RESGID 0x0000
 
@@ -199,7 +234,7 @@ struct ext2_group_desc
     __le16 bg_free_blocks_count; /* Free blocks count */
     __le16 bg_free_inodes_count; /* Free inodes count */
     __le16 bg_used_dirs_count;   /* Directories count */
-    __le16 bg_pad;
+    __le16 bg_flags;             /* EXT2M_BG_* flags */
     __le32 bg_reserved[3];
 } __attribute__((packed));
 
@@ -288,6 +323,66 @@ struct ext2_dir_entry_2
                  // The name must be no longer than 255 bytes after encoding
 } __attribute__((packed));
 
+/*
+ * Hashed directory index. The root follows "." and ".." in the first block of the directory, hidden in the rec_len of "..". An
+ * index node is a block holding one unused entry spanning the whole block, followed by the dx entries.
+ */
+struct ext2_dx_root_info
+{
+    __le32 reserved_zero;
+    __u8 hash_version;
+    __u8 info_length; /* 8 */
+    __u8 indirect_levels;
+    __u8 unused_flags;
+} __attribute__((packed));
+
+struct ext2_dx_entry
+{
+    __le32 hash;  /* lowest hash of the block, the low bit is set if the block continues a run of equal hashes */
+    __le32 block; /* logical block of the directory */
+} __attribute__((packed));
+
+/* in the place of the hash of the first dx entry of a node */
+struct ext2_dx_countlimit
+{
+    __le16 limit;
+    __le16 count;
+} __attribute__((packed));
+
+/*
+ * Extent tree, as in ext4.
+ * Each node is a header followed by eh_max entries. The root lives in i_block (4 entries), other nodes fill a whole block.
+ * Entries of the leaves (eh_depth = 0) are extents, entries of the other nodes are indexes to the node below.
+ */
+#define EXT2M_EXT_MAGIC 0xF30A
+// the longest extent
+#define EXT2M_EXT_MAX_LEN 32768
+
+struct ext2m_extent_header
+{
+    __le16 eh_magic;      /* EXT2M_EXT_MAGIC */
+    __le16 eh_entries;    /* number of valid entries */
+    __le16 eh_max;        /* capacity of store in entries */
+    __le16 eh_depth;      /* has tree real underlying blocks? */
+    __le32 eh_generation; /* generation of the tree */
+} __attribute__((packed));
+
+struct ext2m_extent
+{
+    __le32 ee_block;    /* first logical block extent covers */
+    __le16 ee_len;      /* number of blocks covered by extent */
+    __le16 ee_start_hi; /* high 16 bits of physical block */
+    __le32 ee_start_lo; /* low 32 bits of physical block */
+} __attribute__((packed));
+
+struct ext2m_extent_idx
+{
+    __le32 ei_block;   /* index covers logical blocks from 'block' */
+    __le32 ei_leaf_lo; /* pointer to the physical block of the next level */
+    __le16 ei_leaf_hi; /* high 16 bits of physical block */
+    __u16 ei_unused;
+} __attribute__((packed));
+
 constexpr auto SUPER_BLOCK_SIZE = sizeof(ext2_super_block);
 constexpr auto GROUP_DESC_SIZE = sizeof(ext2_group_desc);
 constexpr auto INODE_SIZE = sizeof(ext2_inode);
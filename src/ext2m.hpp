@@ -5,19 +5,28 @@
 #include "config.hpp"
 #include <time.h>
 #include "bitmap.hpp"
+#include "extentcache.hpp"
+#include "inodecache.hpp"
+#include "dentrycache.hpp"
+#include "freespace.hpp"
 #include <memory>
 #include <functional>
 #include <string>
 #include <iostream>
-
-/*
- * TODOLISTS:
- *   Not modify *_free_* variable
- */
+#include <algorithm>
+#include <cstdlib>
+#include <unordered_map>
+#include <deque>
+#include <cstddef>
+#include <random>
 
 #define EXT2M_I_BLOCK_END 0
 #define EXT2M_I_BLOCK_SPARSE 1
 
+// Blocks reserved for an inode's next appends, see s_prealloc_blocks
+#define EXT2M_PREALLOC_BLOCKS 8
+#define EXT2M_PREALLOC_DIR_BLOCKS 4
+
 namespace Ext2m
 {
 
@@ -78,6 +87,17 @@ namespace Ext2m
         __u8 file_type;
         std::string name;
     };
+    // an entry read in place from a directory block, see Ext2m::dir_iterator
+    struct dirent_view
+    {
+        uint32_t inode;
+        uint8_t file_type;
+        uint8_t name_len;
+        const char *name; // not null terminated
+
+        std::string str() const { return std::string(name, name_len); }
+        bool is(const char *s) const { return strlen(s) == name_len and memcmp(s, name, name_len) == 0; }
+    };
     class Ext2m
     {
         uint8_t _buf[BLOCK_SIZE];
@@ -88,7 +108,27 @@ namespace Ext2m
         size_t inodes_table_block_count;
 
         ext2_super_block _superb;
-        ext2_group_desc *_group_desc;
+        ext2_group_desc *_group_desc = nullptr;
+        // free extents of each group, built at mount and kept in sync with the block bitmaps
+        std::vector<FreeSpace> _free_space;
+        // next inode table block lazy_init() looks at, per group
+        std::vector<uint32_t> _itable_cursor;
+
+        // inode num -> blocks reserved for its next appends in order. They are out of the free-extent index and the free counts but
+        // stay clear in the block bitmap until used, so a window left behind by a crash is free again at the next mount.
+        std::unordered_map<uint32_t, std::deque<uint32_t>> _prealloc;
+        // block maps of the recently used inodes
+        ExtentCache _extents{EXTENT_CACHE_CAPACITY, EXT2M_I_BLOCK_SPARSE};
+        // decoded inodes of the recently used files, written back by flush_inodes()
+        InodeCache _inodes{INODE_CACHE_CAPACITY};
+        // names looked up in the recently used directories, kept in sync by add_entry_to_inode() and free_entry_to_inode()
+        DentryCache _dentries{DENTRY_CACHE_CAPACITY};
+        // bumped on every entry added or freed, an open dir_iterator revalidates its position once it changes
+        uint64_t _dir_version = 0;
+        // linear directories -> the largest free slot of each of their blocks, so an insert goes straight to a block with room
+        std::unordered_map<uint32_t, std::vector<uint16_t>> _dir_slots;
+        // directories -> entries freed since they were last compacted, see compact_dirs()
+        std::unordered_map<uint32_t, uint32_t> _dir_frees;
 
         /**
          * @brief check if the disk is ext2-format disk
@@ -180,6 +220,16 @@ namespace Ext2m
             return get_inode_table_index(group_index) + inodes_table_block_count;
         }
 
+        /**
+         * @brief Get the number of blocks at the start of every group used by its metadata.
+         * super block, group descriptor table, block bitmap, inode bitmap and inode table.
+         * @return number of blocks
+         */
+        size_t group_meta_blocks()
+        {
+            return 3 + group_desc_block_count + inodes_table_block_count;
+        }
+
         /**
          * @brief Write the block-group's super block to disk
          *
@@ -213,6 +263,15 @@ namespace Ext2m
          */
         BitMap get_block_bitmap(size_t group_index)
         {
+            if (_group_desc != nullptr and (_group_desc[group_index].bg_flags & EXT2M_BG_BLOCK_UNINIT))
+            {
+                // never written, only the group's metadata is in use
+                memset(_buf, 0, BLOCK_SIZE);
+                BitMap bm(_buf, blocks_per_group);
+                for (size_t i = 0; i < group_meta_blocks(); i++)
+                    bm.set(i);
+                return bm;
+            }
             _disk.read_block(get_block_bitmap_index(group_index), _buf);
             return BitMap(_buf, blocks_per_group);
         }
@@ -224,6 +283,11 @@ namespace Ext2m
          */
         BitMap get_inode_bitmap(size_t group_index)
         {
+            if (_group_desc != nullptr and (_group_desc[group_index].bg_flags & EXT2M_BG_INODE_UNINIT))
+            {
+                memset(_buf, 0, BLOCK_SIZE);
+                return BitMap(_buf, inodes_per_group);
+            }
             _disk.read_block(get_inode_bitmap_index(group_index), _buf);
             return BitMap(_buf, inodes_per_group);
         }
@@ -241,6 +305,8 @@ namespace Ext2m
             memset(_buf, 0, BLOCK_SIZE);
             memcpy(_buf, buf, size);
             _disk.write_block(get_block_bitmap_index(group_index), _buf);
+            if (_group_desc != nullptr)
+                _group_desc[group_index].bg_flags &= ~EXT2M_BG_BLOCK_UNINIT;
         }
         /**
          * @brief Write the block-group's {inode bitmap} object to the disk.
@@ -256,7 +322,194 @@ namespace Ext2m
             memset(_buf, 0, BLOCK_SIZE);
             memcpy(_buf, buf, size);
             _disk.write_block(get_inode_bitmap_index(group_index), _buf);
+            if (_group_desc != nullptr)
+                _group_desc[group_index].bg_flags &= ~EXT2M_BG_INODE_UNINIT;
+        }
+        /**
+         * @brief Get all runs of free blocks in a block bitmap.
+         *
+         * @param bitmap
+         * @return std::vector<std::pair<uint32_t, uint32_t>> <first bit, length> in ascending order.
+         */
+        std::vector<std::pair<uint32_t, uint32_t>> get_free_runs(const BitMap &bitmap)
+        {
+            std::vector<std::pair<uint32_t, uint32_t>> runs;
+            uint32_t start = bitmap.nextBit(0);
+            while (start != (uint32_t)-1)
+            {
+                auto len = bitmap.runLength(start);
+                runs.emplace_back(start, len);
+                start = bitmap.nextBit(start + len);
+            }
+            return runs;
+        }
+
+        /**
+         * @brief Account allocated (delta < 0) or freed (delta > 0) blocks in the group descriptor and the super block.
+         *
+         * @param group_index
+         * @param delta
+         */
+        void account_blocks(size_t group_index, int delta)
+        {
+            if (_group_desc == nullptr) // still formatting
+                return;
+            _group_desc[group_index].bg_free_blocks_count += delta;
+            _superb.s_free_blocks_count += delta;
+        }
+
+        /**
+         * @brief Account allocated (delta < 0) or freed (delta > 0) inodes in the group descriptor and the super block.
+         *
+         * @param group_index
+         * @param delta
+         * @param is_dir
+         */
+        void account_inodes(size_t group_index, int delta, bool is_dir)
+        {
+            if (_group_desc == nullptr)
+                return;
+            _group_desc[group_index].bg_free_inodes_count += delta;
+            _superb.s_free_inodes_count += delta;
+            if (is_dir)
+                _group_desc[group_index].bg_used_dirs_count -= delta;
+        }
+
+        /**
+         * @brief Recount the free blocks and free inodes of every group from the bitmaps, and build the free-extent index.
+         * bg_used_dirs_count is kept as it is on the disk.
+         */
+        void recount_free()
+        {
+            _superb.s_free_blocks_count = 0;
+            _superb.s_free_inodes_count = 0;
+            _free_space.assign(full_group_count, FreeSpace());
+            for (size_t i = 0; i < full_group_count; i++)
+            {
+                auto &&desc = _group_desc[i];
+                for (auto &&r : get_free_runs(get_block_bitmap(i)))
+                    _free_space[i].insert(r.first, r.second);
+                desc.bg_free_blocks_count = _free_space[i].total();
+                // reserved inodes are never handed out
+                auto first = (i == 0) ? _superb.s_first_ino - 1 : 0;
+                desc.bg_free_inodes_count = get_inode_bitmap(i).count(first, false);
+                _superb.s_free_blocks_count += desc.bg_free_blocks_count;
+                _superb.s_free_inodes_count += desc.bg_free_inodes_count;
+            }
+        }
+
+        /**
+         * @brief Write the in-memory super block and group descriptor table back to group 0.
+         */
+        void write_fs_info()
+        {
+            if (_group_desc == nullptr) // still formatting
+                return;
+            _superb.s_wtime = time(NULL);
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE * group_desc_block_count]);
+            memset(mbuf.get(), 0, BLOCK_SIZE * group_desc_block_count);
+            memcpy(mbuf.get(), _group_desc, sizeof(ext2_group_desc) * full_group_count);
+            // the reserved blocks are free on the disk, as in the bitmaps
+            auto superb = _superb;
+            auto *descs = (ext2_group_desc *)mbuf.get();
+            for (auto &&i : _prealloc)
+            {
+                for (auto &&b : i.second)
+                    descs[(b - 1) / blocks_per_group].bg_free_blocks_count++;
+                superb.s_free_blocks_count += i.second.size();
+            }
+
+            memset(_buf, 0, BLOCK_SIZE);
+            memcpy(_buf, &superb, sizeof(superb));
+            write_super_block(0, _buf);
+            write_group_desc_table(0, mbuf.get());
+        }
+
+        /**
+         * @brief Find a group for a new directory, Orlov style.
+         * Top-level directories are spread over the groups with above-average free inodes and blocks, taking the one with the
+         * fewest directories. Other directories stay in or near the parent's group while it is not crowded.
+         *
+         * @param parent_group
+         * @param top_level the parent is the root directory
+         * @return group index, -1 if no group has a free inode.
+         */
+        ssize_t find_group_dir(size_t parent_group, bool top_level)
+        {
+            size_t avefreei = _superb.s_free_inodes_count / full_group_count;
+            size_t avefreeb = _superb.s_free_blocks_count / full_group_count;
+            size_t ndirs = 0;
+            for (size_t i = 0; i < full_group_count; i++)
+                ndirs += _group_desc[i].bg_used_dirs_count;
+
+            if (top_level)
+            {
+                ssize_t best = -1;
+                for (size_t i = 0; i < full_group_count; i++)
+                {
+                    auto &&desc = _group_desc[i];
+                    if (desc.bg_free_inodes_count == 0 or desc.bg_free_inodes_count < avefreei or desc.bg_free_blocks_count < avefreeb)
+                        continue;
+                    if (best == -1 or desc.bg_used_dirs_count < _group_desc[best].bg_used_dirs_count or
+                        (desc.bg_used_dirs_count == _group_desc[best].bg_used_dirs_count and desc.bg_free_blocks_count > _group_desc[best].bg_free_blocks_count))
+                        best = i;
+                }
+                if (best != -1)
+                    return best;
+            }
+            else
+            {
+                // at most a quarter more directories than the average, and enough room left
+                size_t max_dirs = ndirs / full_group_count + inodes_per_group / 16;
+                size_t min_inodes = avefreei - avefreei / 4;
+                size_t min_blocks = avefreeb - avefreeb / 4;
+                for (size_t k = 0; k < full_group_count; k++)
+                {
+                    size_t i = (parent_group + k) % full_group_count;
+                    auto &&desc = _group_desc[i];
+                    if (desc.bg_free_inodes_count == 0)
+                        continue;
+                    if (desc.bg_used_dirs_count >= max_dirs or desc.bg_free_inodes_count < min_inodes or desc.bg_free_blocks_count < min_blocks)
+                        continue;
+                    return i;
+                }
+            }
+            for (size_t k = 0; k < full_group_count; k++)
+            {
+                size_t i = (parent_group + k) % full_group_count;
+                if (_group_desc[i].bg_free_inodes_count > 0)
+                    return i;
+            }
+            return -1;
+        }
+
+        /**
+         * @brief Find a group for a new file: the parent's group, then quadratic hashing over the groups, then a linear scan.
+         *
+         * @param parent_group
+         * @return group index, -1 if no group has a free inode.
+         */
+        ssize_t find_group_other(size_t parent_group)
+        {
+            auto &&desc = _group_desc[parent_group];
+            if (desc.bg_free_inodes_count > 0 and desc.bg_free_blocks_count > 0)
+                return parent_group;
+            size_t i = parent_group;
+            for (size_t j = 1; j < full_group_count; j <<= 1)
+            {
+                i = (i + j) % full_group_count;
+                if (_group_desc[i].bg_free_inodes_count > 0 and _group_desc[i].bg_free_blocks_count > 0)
+                    return i;
+            }
+            for (size_t k = 0; k < full_group_count; k++)
+            {
+                i = (parent_group + k) % full_group_count;
+                if (_group_desc[i].bg_free_inodes_count > 0)
+                    return i;
+            }
+            return -1;
         }
+
         /**
          * @brief read nessary information from the super block.
          *
@@ -286,13 +539,16 @@ namespace Ext2m
          * @param _block_ind
          * @param level
          * @param arr
+         * @param meta if not null, the indirect blocks are collected here.
          * @return true for continue traverse, false  for reach the end
          */
-        bool __get_inode_all_blocks__(uint32_t _block_ind, int level, std::vector<uint32_t> &arr)
+        bool __get_inode_all_blocks__(uint32_t _block_ind, int level, std::vector<uint32_t> &arr, std::vector<uint32_t> *meta = nullptr)
         {
             assert(level < 4 and level >= 0);
             if (_block_ind == EXT2M_I_BLOCK_END)
                 return false;
+            if (_block_ind == EXT2M_I_BLOCK_SPARSE) // a hole, no block
+                return true;
             if (level == 0) // direct access block
             {
                 arr.push_back(_block_ind);
@@ -300,6 +556,8 @@ namespace Ext2m
             }
             else // the all indirect block
             {
+                if (meta != nullptr)
+                    meta->push_back(_block_ind);
                 std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
                 _disk.read_block(_block_ind, mbuf.get());
                 uint8_t *_start = mbuf.get();
@@ -309,7 +567,7 @@ namespace Ext2m
                 {
                     __le32 bn = *(__le32 *)_start;
                     _start += sizeof(__le32);
-                    flag &= __get_inode_all_blocks__(bn, level - 1, arr);
+                    flag &= __get_inode_all_blocks__(bn, level - 1, arr, meta);
                     if (not flag)
                         return false;
                 }
@@ -322,34 +580,17 @@ namespace Ext2m
          *
          * @param _block_ind the inode's block index
          * @param level 0 for direct access block, 1 for the first indirect block, 2 for the second indirect block, 3 for the third indirect block.
-         * @param group_index
+         * @param alloc allocate a block near the goal.
+         * @param goal the block after the file's last block, updated while walking down.
          * @return ssize_t the block index added to the inode.
          */
-        ssize_t __add_block_to_inode__(uint32_t _block_ind, int level, uint32_t group_index)
+        ssize_t __add_block_to_inode__(uint32_t _block_ind, int level, const std::function<uint32_t(uint32_t)> &alloc, uint32_t &goal)
         {
             switch (level)
             {
             case 1:
             {
-                _disk.read_block(_block_ind, _buf);
-                uint32_t *_start = (uint32_t *)_buf;
-                uint32_t *_end = _start + BLOCK_SIZE / sizeof(uint32_t);
-                while (_start != _end)
-                {
-                    if (*_start == EXT2M_I_BLOCK_END)
-                    {
-                        auto n = ballocs(group_index, 1).front();
-                        *_start = n;
-                        _disk.write_block(_block_ind, _buf);
-                        return n;
-                    }
-                    _start++;
-                }
-                return -1;
-                break;
-            }
-            case 2:
-            {
+                // ballocs() reads the bitmap into _buf, so keep our own buffer
                 std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
                 _disk.read_block(_block_ind, mbuf.get());
                 uint32_t *_start = (uint32_t *)mbuf.get();
@@ -358,40 +599,44 @@ namespace Ext2m
                 {
                     if (*_start == EXT2M_I_BLOCK_END)
                     {
-                        auto n = ballocs(group_index, 1).front();
+                        auto n = alloc(goal);
                         *_start = n;
                         _disk.write_block(_block_ind, mbuf.get());
-                        memset(_buf, 0, BLOCK_SIZE);
-                        _disk.write_block(n, _buf);
-                        auto ret = __add_block_to_inode__(n, level - 1, group_index);
-                        return ret;
+                        goal = n + 1;
+                        return n;
                     }
+                    goal = *_start + 1;
                     _start++;
                 }
                 return -1;
                 break;
             }
+            case 2:
             case 3:
             {
                 std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
                 _disk.read_block(_block_ind, mbuf.get());
                 uint32_t *_start = (uint32_t *)mbuf.get();
                 uint32_t *_end = _start + BLOCK_SIZE / sizeof(uint32_t);
-                while (_start != _end)
+                uint32_t *_last = nullptr;
+                while (_start != _end and *_start != EXT2M_I_BLOCK_END)
+                    _last = _start++;
+                // the last used sub-tree may still have room
+                if (_last != nullptr)
                 {
-                    if (*_start == EXT2M_I_BLOCK_END)
-                    {
-                        auto n = ballocs(group_index, 1).front();
-                        *_start = n;
-                        _disk.write_block(_block_ind, mbuf.get());
-                        memset(_buf, 0, BLOCK_SIZE);
-                        _disk.write_block(n, _buf);
-                        auto ret = __add_block_to_inode__(n, level - 1, group_index);
+                    auto ret = __add_block_to_inode__(*_last, level - 1, alloc, goal);
+                    if (ret != -1)
                         return ret;
-                    }
-                    _start++;
                 }
-                return -1;
+                if (_start == _end)
+                    return -1;
+                auto n = alloc(goal);
+                *_start = n;
+                _disk.write_block(_block_ind, mbuf.get());
+                memset(_buf, 0, BLOCK_SIZE);
+                _disk.write_block(n, _buf);
+                goal = n + 1;
+                return __add_block_to_inode__(n, level - 1, alloc, goal);
                 break;
             }
             default:
@@ -418,13 +663,90 @@ namespace Ext2m
              */
             bool next_entry(entry &e)
             {
-                if (_now == _end)
+                while (_now != _end)
+                {
+                    ext2_dir_entry_2 *ent = (ext2_dir_entry_2 *)_now;
+                    _now += ent->rec_len;
+                    // unused, e.g. an index node of a hashed directory
+                    if (ent->inode == 0)
+                        continue;
+                    e.inode = ent->inode;
+                    e.file_type = ent->file_type;
+                    e.name = std::string((char *)ent->name, ent->name_len);
+                    return true;
+                }
+                return false;
+            }
+
+            /**
+             * @brief Find a name in a block, the length first and then the bytes of each entry are compared in place.
+             *
+             * @param block
+             * @param name not null terminated
+             * @param len
+             * @return ssize_t the inode of the name, -1 if not found.
+             */
+            static ssize_t find(const uint8_t *block, const char *name, size_t len)
+            {
+                for (const uint8_t *p = block; p != block + BLOCK_SIZE;)
+                {
+                    auto *ent = (const ext2_dir_entry_2 *)p;
+                    if (ent->inode != 0 and ent->name_len == len and memcmp(ent->name, name, len) == 0)
+                        return ent->inode;
+                    p += ent->rec_len;
+                }
+                return -1;
+            }
+
+            // the record size of an entry whose name is name_len bytes
+            static size_t entry_size(size_t name_len) { return roundup(name_len + 1 + sizeof(ext2_dir_entry_2), 4); }
+
+            /**
+             * @brief Get the largest free slot of the block, an entry of this record size or less fits in.
+             *
+             * @return uint16_t 0 if the block is full.
+             */
+            uint16_t largest_free() const
+            {
+                size_t ret = 0;
+                for (uint8_t *p = _block; p != _end;)
+                {
+                    ext2_dir_entry_2 *ent = (ext2_dir_entry_2 *)p;
+                    ret = std::max<size_t>(ret, ent->inode == 0 ? ent->rec_len : ent->rec_len - entry_size(ent->name_len));
+                    p += ent->rec_len;
+                }
+                return ret;
+            }
+
+            /**
+             * @brief Pack the entries at the start of the block in their order, so its free space is one slot at the end.
+             *
+             * @return true if the block changed.
+             */
+            bool compact()
+            {
+                uint8_t packed[BLOCK_SIZE] = {};
+                size_t size = 0;
+                ext2_dir_entry_2 *last = nullptr;
+                for (uint8_t *p = _block; p != _end;)
+                {
+                    ext2_dir_entry_2 *ent = (ext2_dir_entry_2 *)p;
+                    p += ent->rec_len;
+                    if (ent->inode == 0)
+                        continue;
+                    auto len = entry_size(ent->name_len);
+                    last = (ext2_dir_entry_2 *)(packed + size);
+                    memcpy(last, ent, sizeof(ext2_dir_entry_2) + ent->name_len);
+                    last->rec_len = len;
+                    size += len;
+                }
+                if (last == nullptr)
+                    ((ext2_dir_entry_2 *)packed)->rec_len = BLOCK_SIZE;
+                else
+                    last->rec_len += BLOCK_SIZE - size;
+                if (memcmp(packed, _block, BLOCK_SIZE) == 0)
                     return false;
-                ext2_dir_entry_2 *ent = (ext2_dir_entry_2 *)_now;
-                e.inode = ent->inode;
-                e.file_type = ent->file_type;
-                e.name = std::string((char *)ent->name, ent->name_len);
-                _now += ent->rec_len;
+                memcpy(_block, packed, BLOCK_SIZE);
                 return true;
             }
 
@@ -435,13 +757,22 @@ namespace Ext2m
              */
             bool add_entry(const entry &e)
             {
-                size_t e_size = roundup(e.name.size() + 1 + sizeof(ext2_dir_entry_2), 4);
+                size_t e_size = entry_size(e.name.size());
                 uint8_t *_now = _block;
                 uint8_t *_end = _block + BLOCK_SIZE;
                 while (_now != _end)
                 {
                     ext2_dir_entry_2 *ent = (ext2_dir_entry_2 *)_now;
-                    size_t ent_size = roundup(ent->name_len + 1 + sizeof(ext2_dir_entry_2), 4);
+                    if (ent->inode == 0 and ent->rec_len >= e_size)
+                    {
+                        // an unused entry, e.g. the first one of an empty leaf
+                        ent->inode = e.inode;
+                        ent->file_type = e.file_type;
+                        ent->name_len = e.name.size();
+                        strcpy((char *)ent->name, e.name.c_str());
+                        return true;
+                    }
+                    size_t ent_size = entry_size(ent->name_len);
                     assert(ent->rec_len >= ent_size);
                     size_t remain_size = ent->rec_len - ent_size;
                     if (remain_size >= e_size)
@@ -480,6 +811,12 @@ namespace Ext2m
                         assert(strcmp((char *)ent->name, ".") != 0);
                         assert(strcmp((char *)ent->name, "..") != 0);
 
+                        // the first entry of a block has no one to merge into, it is left unused
+                        if (_pre == nullptr)
+                        {
+                            ent->inode = 0;
+                            return true;
+                        }
                         ext2_dir_entry_2 *precd = (ext2_dir_entry_2 *)_pre;
                         precd->rec_len += ent->rec_len;
 
@@ -498,8 +835,7 @@ namespace Ext2m
         {
             ext2_inode inode;
             get_inode(inode_num, inode);
-            auto n = inode.i_block[0];
-            assert(n != 0);
+            auto n = bmaps(inode, 0, 1).at(0);
             _disk.read_block(n, _buf);
             entry_block eb(_buf);
             entry e;
@@ -524,6 +860,12 @@ namespace Ext2m
                 read_info();
             _disk.read_block(1, _buf);
             this->_superb = *(ext2_super_block *)_buf;
+            // images formatted before preallocation was supported carry 0 here
+            if (not(_superb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_PREALLOC))
+            {
+                _superb.s_prealloc_blocks = EXT2M_PREALLOC_BLOCKS;
+                _superb.s_prealloc_dir_blocks = EXT2M_PREALLOC_DIR_BLOCKS;
+            }
             this->_group_desc = new ext2_group_desc[full_group_count];
             uint8_t *buf = new uint8_t[BLOCK_SIZE * group_desc_block_count];
             for (size_t i = 0; i < group_desc_block_count; i++)
@@ -532,20 +874,65 @@ namespace Ext2m
             }
             memcpy(_group_desc, buf, sizeof(ext2_group_desc) * full_group_count);
             delete[] buf;
+            // bg_flags was padding left uninitialized by older formats, it only means something with the feature bit
+            if (not(_superb.s_feature_ro_compat & EXT2M_FEATURE_RO_COMPAT_UNINIT_BG))
+            {
+                for (size_t i = 0; i < full_group_count; i++)
+                    _group_desc[i].bg_flags = 0;
+            }
+            recount_free();
         };
         ~Ext2m()
         {
-            sync();
+            discard_prealloc_if([](uint32_t) { return true; });
+            sync(true);
             delete[] _group_desc;
         }
         /**
          * @brief Synchronize cached writes to persistent storage
+         * @param lazy_times also write the timestamps updated lazily less than LAZYTIME_MAX_AGE seconds ago
          */
-        void sync()
+        void sync(bool lazy_times = false)
         {
+            flush_inodes(lazy_times ? (uint64_t)-1 : time(NULL) - LAZYTIME_MAX_AGE);
+            write_fs_info();
             _disk.flush_all();
         }
 
+        /**
+         * @brief Zero up to budget inode-table blocks of the groups left unzeroed by format().
+         * Only table blocks whose inodes are all free are written, so groups already in use are safe.
+         *
+         * @param budget max number of blocks to write
+         */
+        void lazy_init(size_t budget)
+        {
+            constexpr size_t inodes_per_block = BLOCK_SIZE / INODE_SIZE;
+            std::unique_ptr<uint8_t[]> zero(new uint8_t[BLOCK_SIZE]);
+            memset(zero.get(), 0, BLOCK_SIZE);
+            _itable_cursor.resize(full_group_count, 0);
+            for (size_t i = 0; i < full_group_count and budget > 0; i++)
+            {
+                auto &&desc = _group_desc[i];
+                if (not(desc.bg_flags & EXT2M_BG_INODE_UNZEROED))
+                    continue;
+                auto &&bitmap = get_inode_bitmap(i);
+                auto &&cursor = _itable_cursor[i];
+                for (; cursor < inodes_table_block_count and budget > 0; cursor++)
+                {
+                    bool used = false;
+                    for (size_t j = cursor * inodes_per_block; j < (cursor + 1) * inodes_per_block and j < inodes_per_group; j++)
+                        used |= bitmap.get(j);
+                    if (used)
+                        continue;
+                    _disk.write_block(get_inode_table_index(i) + cursor, zero.get());
+                    budget--;
+                }
+                if (cursor == inodes_table_block_count)
+                    desc.bg_flags &= ~EXT2M_BG_INODE_UNZEROED;
+            }
+        }
+
         /**
          * @brief Format the disk to ext2 format and add root directory
          */
@@ -613,24 +1000,24 @@ namespace Ext2m
                 super_block.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
                 super_block.s_inode_size = INODE_SIZE;
                 super_block.s_block_group_nr = 0;
-                super_block.s_feature_compat = 0;
-                super_block.s_feature_incompat = 0;
-                super_block.s_feature_ro_compat = 0;
+                super_block.s_feature_compat = EXT2_FEATURE_COMPAT_DIR_PREALLOC | EXT2_FEATURE_COMPAT_DIR_INDEX;
+                super_block.s_feature_incompat = EXT2M_FEATURE_INCOMPAT_INLINE_DATA;
+                if (FORMAT_WITH_EXTENTS)
+                    super_block.s_feature_incompat |= EXT2M_FEATURE_INCOMPAT_EXTENTS;
+                super_block.s_feature_ro_compat = EXT2M_FEATURE_RO_COMPAT_UNINIT_BG;
                 memset(super_block.s_uuid, 0, sizeof(super_block.s_uuid));
                 strcpy((char *)super_block.s_volume_name, "*.img");
                 memset(super_block.s_last_mounted, 0, sizeof(super_block.s_last_mounted));
                 super_block.s_algorithm_usage_bitmap = 0;
 
-                // TODO: may be changed later
-                super_block.s_prealloc_blocks = 0;
-                super_block.s_prealloc_dir_blocks = 0;
+                super_block.s_prealloc_blocks = EXT2M_PREALLOC_BLOCKS;
+                super_block.s_prealloc_dir_blocks = EXT2M_PREALLOC_DIR_BLOCKS;
 
                 memset(super_block.s_journal_uuid, 0, sizeof(super_block.s_journal_uuid));
                 super_block.s_journal_inum = 0;
                 super_block.s_journal_dev = 0;
                 super_block.s_last_orphan = 0;
-                memset(super_block.s_hash_seed, 0, sizeof(super_block.s_hash_seed));
-                super_block.s_def_hash_version = 0;
+                init_hash_seed(super_block);
                 super_block.s_default_mount_opts = 0;
                 super_block.s_first_meta_bg = 0;
             }
@@ -648,7 +1035,12 @@ namespace Ext2m
                     desc.bg_free_blocks_count = blocks_per_group - 3 - group_desc_block_count - inodes_table_block_count;
                     desc.bg_free_inodes_count = inodes_per_group;
                     desc.bg_used_dirs_count = 0;
+                    desc.bg_flags = EXT2M_BG_INODE_UNINIT | EXT2M_BG_BLOCK_UNINIT | EXT2M_BG_INODE_UNZEROED;
+                    memset(desc.bg_reserved, 0, sizeof(desc.bg_reserved));
                 }
+                // the root directory
+                group_desc[0].bg_used_dirs_count = 1;
+                group_desc[0].bg_flags = EXT2M_BG_INODE_UNZEROED;
             }
 
             // Some block used for supber block , group descriptor table, inode table, etc.
@@ -674,24 +1066,17 @@ namespace Ext2m
                 delete[] ptr;
             }
 
-            // Initialize each block group
-            for (size_t i = 0; i < full_group_count; i++)
+            // Initialize the bitmaps of block group 0 only. The other groups get theirs on first use,
+            // and the inode tables are zeroed in the background, see lazy_init().
             {
                 memset(_buf, 0, BLOCK_SIZE);
-                size_t start_ind = get_inode_bitmap_index(i);
-                size_t end_ind = get_group_index(i) + blocks_per_group;
-                while (start_ind < end_ind)
-                {
-                    _disk.write_block(start_ind, _buf);
-                    start_ind++;
-                }
-                auto &&bm = get_block_bitmap(i);
-                size_t _end = 3 + group_desc_block_count + inodes_table_block_count;
-                for (size_t _j = 0; _j < _end; _j++)
+                _disk.write_block(get_inode_bitmap_index(0), _buf);
+                BitMap bm(_buf, blocks_per_group);
+                for (size_t _j = 0; _j < group_meta_blocks(); _j++)
                 {
                     bm.set(_j);
                 }
-                write_block_bitmap(i, bm);
+                write_block_bitmap(0, bm);
             }
 
             sync();
@@ -734,69 +1119,278 @@ namespace Ext2m
                 with the value 0 being used to indicate which blocks are not yet allocated for this file.
                 */
                 memset(root_ino.i_block, 0, sizeof(root_ino.i_block));
-                root_ino.i_block[0] = ballocs(0).front();
+                // the first data block of group 0
+                uint32_t root_block = get_data_table_index(0);
+                if (FORMAT_WITH_EXTENTS)
+                {
+                    ext_init_root(root_ino);
+                    ext_header(ext_root(root_ino))->eh_entries = 1;
+                    ext_extents(ext_root(root_ino))[0] = {0, 1, 0, root_block};
+                }
+                else
+                    root_ino.i_block[0] = root_block;
+                auto &&bbm = get_block_bitmap(0);
+                bbm.set(root_block - get_group_index(0));
+                write_block_bitmap(0, bbm);
                 init_entry_block(_buf, 2, 2);
-                _disk.write_block(root_ino.i_block[0], _buf);
+                _disk.write_block(root_block, _buf);
             }
             write_inode(2, root_ino);
             sync();
         };
 
         /**
-         * @brief Get all entrys belong to the inode.
-         *
-         * @param inode_num
-         * @return std::vector<entry>
+         * @brief A readdir cursor over a directory, "." and ".." first. A linear directory is read in place from its cached blocks,
+         * one block pinned at a time. An indexed directory is read in hash order like ext3 does, one hash range (a leaf, and its
+         * continuation leaves) at a time, so a leaf split under the cursor neither repeats nor skips entries. Either way a
+         * directory of any size is walked in constant memory. An entry added or freed while iterating may be returned or not, the
+         * other ones are returned once, unless the directory gets indexed under the cursor.
          */
-        std::vector<entry> get_inode_all_entry(uint32_t inode_num)
+        class dir_iterator
         {
-            std::vector<entry> ret;
-            auto all_blocks = get_inode_all_blocks(inode_num);
-            for (auto &&i : all_blocks)
+            Ext2m &_fs;
+            const uint32_t _inode_num;
+            // linear cursor
+            uint64_t _lblock = 0;
+            uint32_t _block = 0; // the pinned block, 0 for none
+            const uint8_t *_data = nullptr;
+            size_t _offset = 0;
+            uint64_t _version;
+            // hash order cursor, once past the first block of an indexed directory
+            bool _indexed = false;
+            uint64_t _hash_pos = 0; // the hashes below it are read already
+            struct hashed_entry
             {
-                _disk.read_block(i, _buf);
-                entry_block eb(_buf);
-                entry e;
-                while (eb.next_entry(e))
+                uint32_t hash;
+                uint32_t inode;
+                uint8_t file_type;
+                uint8_t name_len;
+                uint16_t name; // offset in _names
+            };
+            std::vector<hashed_entry> _range; // the entries of the last range read, in hash order
+            size_t _range_at = 0;
+            std::vector<char> _names;
+
+            void release()
+            {
+                if (_data != nullptr)
+                    _fs._disk.unpin(_block);
+                _data = nullptr;
+                _block = 0;
+            }
+
+            /**
+             * @brief Read the entries of the hash range starting at _hash_pos, up to the first leaf that does not continue it.
+             */
+            void read_range()
+            {
+                std::vector<dx_frame> frames;
+                uint32_t hash = _hash_pos, start;
+                auto leaf = _fs.dx_probe(_inode_num, nullptr, frames, hash);
+                auto version = dx_info(frames[0].node.get())->hash_version;
+                uint64_t end = (uint64_t)EXT2_HTREE_EOF << 1;
+                _range.clear();
+                _names.clear();
+                do
+                {
+                    auto block = _fs.bmap(_inode_num, leaf);
+                    auto *data = _fs._disk.pin(block);
+                    for (size_t p = 0; p < BLOCK_SIZE;)
+                    {
+                        auto *ent = (const ext2_dir_entry_2 *)(data + p);
+                        p += ent->rec_len;
+                        if (ent->inode == 0)
+                            continue;
+                        auto h = _fs.dx_hash((const char *)ent->name, ent->name_len, version);
+                        if (h < _hash_pos)
+                            continue;
+                        _range.push_back({h, ent->inode, ent->file_type, ent->name_len, (uint16_t)_names.size()});
+                        _names.insert(_names.end(), (const char *)ent->name, (const char *)ent->name + ent->name_len);
+                    }
+                    _fs._disk.unpin(block);
+                    if (not _fs.dx_next(_inode_num, frames, leaf, start))
+                        break;
+                    end = start & ~1u;
+                } while (start & 1);
+                std::stable_sort(_range.begin(), _range.end(), [](const hashed_entry &a, const hashed_entry &b) { return a.hash < b.hash; });
+                _range_at = 0;
+                _hash_pos = end;
+            }
+
+        public:
+            dir_iterator(Ext2m &fs, uint32_t inode_num) : _fs(fs), _inode_num(inode_num), _version(fs._dir_version) {}
+            dir_iterator(const dir_iterator &) = delete;
+            dir_iterator &operator=(const dir_iterator &) = delete;
+            ~dir_iterator() { release(); }
+
+            uint32_t inode_num() const { return _inode_num; }
+
+            /**
+             * @brief Get the next entry.
+             *
+             * @param d entry to be filled, its name is valid until the next call.
+             * @return true for success.
+             * @return false for reach end of directory.
+             */
+            bool next(dirent_view &d)
+            {
+                while (_indexed)
+                {
+                    if (_range_at == _range.size())
+                    {
+                        if (_hash_pos >= ((uint64_t)EXT2_HTREE_EOF << 1))
+                            return false;
+                        read_range();
+                        continue;
+                    }
+                    auto &&e = _range[_range_at++];
+                    d.inode = e.inode;
+                    d.file_type = e.file_type;
+                    d.name_len = e.name_len;
+                    d.name = _names.data() + e.name;
+                    return true;
+                }
+                for (;;)
                 {
-                    if (ret.size() > 2 and (e.name == "." or e.name == ".."))
+                    if (_data == nullptr)
+                    {
+                        if (_lblock == 1)
+                        {
+                            // past "." and "..", an indexed directory goes on in hash order
+                            ext2_inode inode;
+                            _fs.get_inode(_inode_num, inode);
+                            if (is_indexed_dir(inode))
+                            {
+                                _indexed = true;
+                                return next(d);
+                            }
+                        }
+                        auto block = _fs.bmap(_inode_num, _lblock);
+                        if (block == EXT2M_I_BLOCK_END)
+                            return false;
+                        if (block == EXT2M_I_BLOCK_SPARSE)
+                        {
+                            _lblock++;
+                            continue;
+                        }
+                        _data = _fs._disk.pin(block);
+                        _block = block;
+                        _offset = 0;
+                        _version = _fs._dir_version;
+                    }
+                    if (_version != _fs._dir_version)
+                    {
+                        // the block may have changed under the cursor, go on from the first entry starting at or after it
+                        size_t p = 0;
+                        while (p < _offset)
+                            p += ((const ext2_dir_entry_2 *)(_data + p))->rec_len;
+                        _offset = p;
+                        _version = _fs._dir_version;
+                    }
+                    if (_offset >= BLOCK_SIZE)
+                    {
+                        release();
+                        _lblock++;
+                        continue;
+                    }
+                    auto *ent = (const ext2_dir_entry_2 *)(_data + _offset);
+                    assert(ent->rec_len != 0);
+                    _offset += ent->rec_len;
+                    // unused, e.g. the first entry of an empty leaf
+                    if (ent->inode == 0)
+                        continue;
+                    d.inode = ent->inode;
+                    d.file_type = ent->file_type;
+                    d.name_len = ent->name_len;
+                    d.name = (const char *)ent->name;
+                    // the blocks added to a linear directory repeat "." and ".."
+                    if (_lblock > 0 and (d.is(".") or d.is("..")))
                         continue;
-                    ret.push_back(e);
+                    return true;
                 }
             }
-            return ret;
+
+            // start over from the first entry
+            void rewind()
+            {
+                release();
+                _lblock = 0;
+                _offset = 0;
+                _indexed = false;
+                _hash_pos = 0;
+                _range.clear();
+                _names.clear();
+                _range_at = 0;
+            }
+        };
+
+        /**
+         * @brief Get the block group an inode lives in.
+         *
+         * @param inode_num
+         * @return size_t group index
+         */
+        size_t inode_group(size_t inode_num)
+        {
+            return (inode_num - 1) / inodes_per_group;
         }
 
         /**
          * @brief Find an avaialble inode index, and modify the inode bitmap.
+         * Directories are spread with find_group_dir(), files go to their parent's group or near it.
          *
+         * @param parent_inode the directory the new inode is created in.
+         * @param is_dir
          * @return inode num , if failed , return 0.
          */
-        size_t ialloc()
+        size_t ialloc(uint32_t parent_inode = ROOT_INODE, bool is_dir = false)
         {
-            for (size_t i = 0; i < full_group_count; i++)
+            auto &&ret = iallocs(parent_inode, 1, is_dir);
+            return ret.empty() ? 0 : ret[0];
+        }
+
+        /**
+         * @brief Find count available inodes at once, each inode bitmap is written once. They are taken in inode num order from the
+         * group ialloc() would pick, then from the following groups.
+         *
+         * @param parent_inode the directory the new inodes are created in.
+         * @param count
+         * @param is_dir
+         * @return std::vector<uint32_t> the inode nums, empty if there are not count free inodes.
+         */
+        std::vector<uint32_t> iallocs(uint32_t parent_inode, size_t count, bool is_dir = false)
+        {
+            std::vector<uint32_t> ret;
+            if (count == 0 or count > _superb.s_free_inodes_count)
+                return ret;
+            size_t parent_group = inode_group(parent_inode);
+            ssize_t group = is_dir ? find_group_dir(parent_group, parent_inode == ROOT_INODE) : find_group_other(parent_group);
+            if (group == -1)
+                return ret;
+            ret.reserve(count);
+            for (size_t k = 0; k < full_group_count and ret.size() < count; k++)
             {
+                size_t i = (group + k) % full_group_count;
+                if (_group_desc[i].bg_free_inodes_count == 0)
+                    continue;
                 // inode num starts from 1
                 size_t start_inode_n = i * inodes_per_group + 1;
                 auto &&bitmap = get_inode_bitmap(i);
-                uint32_t start = 0;
-                while (start != (uint32_t)-1)
+                uint32_t start = (start_inode_n < _superb.s_first_ino) ? _superb.s_first_ino - start_inode_n : 0;
+                size_t taken = 0;
+                for (start = bitmap.nextBit(start); start != (uint32_t)-1 and ret.size() < count; start = bitmap.nextBit(start + 1))
                 {
-                    start = bitmap.nextBit(start);
-                    if (start != (uint32_t)-1)
-                    {
-                        if (start + start_inode_n < _superb.s_first_ino)
-                        {
-                            start++;
-                            continue;
-                        }
-                        bitmap.set(start);
-                        write_inode_bitmap(i, bitmap);
-                        return start + start_inode_n;
-                    }
+                    bitmap.set(start);
+                    ret.push_back(start + start_inode_n);
+                    taken++;
                 }
+                if (taken == 0)
+                    continue;
+                write_inode_bitmap(i, bitmap);
+                account_inodes(i, -(int)taken, is_dir);
             }
-            return 0;
+            assert(ret.size() == count);
+            return ret;
         }
 
         void init_inode(ext2_inode &inode, __le16 mode, __le16 uid, __le16 gid)
@@ -812,48 +1406,128 @@ namespace Ext2m
             inode.i_mtime = inode.i_ctime;
             inode.i_atime = inode.i_ctime;
             inode.i_size = 0;
+            if (_superb.s_feature_incompat & EXT2M_FEATURE_INCOMPAT_EXTENTS)
+                ext_init_root(inode);
+        }
+
+        /**
+         * @brief Allocate and write count new inodes of a mode at once, e.g. for a bulk create. Their inode-table blocks are written
+         * once each, and a table block whose inodes are all new is not even read. A new directory gets its first block with "." and
+         * "..", the blocks of the batch being allocated together.
+         *
+         * @param parent_inode the directory they are created in.
+         * @param count
+         * @param mode EXT2_S_IFREG or EXT2_S_IFDIR with the permission bits.
+         * @return std::vector<uint32_t> the new inode nums, empty if there are not enough free inodes or blocks.
+         */
+        std::vector<uint32_t> create_inodes(uint32_t parent_inode, size_t count, __le16 mode)
+        {
+            bool is_dir = (mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+            if (is_dir and count > _superb.s_free_blocks_count)
+                return {};
+            auto &&nums = iallocs(parent_inode, count, is_dir);
+            if (nums.empty())
+                return nums;
+            ext2_inode inode;
+            // TODO: UID, GID
+            init_inode(inode, mode, 0, 0);
+            std::vector<ext2_inode> inodes(nums.size(), inode);
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            if (is_dir)
+            {
+                auto &&blocks = ballocs(inode_group(nums[0]), nums.size());
+                for (size_t i = 0; i < nums.size(); i++)
+                {
+                    if (is_extent_inode(inodes[i]))
+                    {
+                        ext_header(ext_root(inodes[i]))->eh_entries = 1;
+                        ext_extents(ext_root(inodes[i]))[0] = {0, 1, 0, blocks[i]};
+                    }
+                    else
+                        inodes[i].i_block[0] = blocks[i];
+                    init_entry_block(mbuf.get(), nums[i], parent_inode);
+                    _disk.write_block(blocks[i], mbuf.get());
+                }
+            }
+
+            auto *inode_table = (ext2_inode *)mbuf.get();
+            for (size_t i = 0; i < nums.size();)
+            {
+                // the nums of a group are in order, those sharing a table block are next to each other
+                auto table_block = locate_inode(nums[i]).first;
+                size_t j = i;
+                while (j < nums.size() and locate_inode(nums[j]).first == table_block)
+                    j++;
+                if (j - i < BLOCK_SIZE / INODE_SIZE)
+                    _disk.read_block(table_block, mbuf.get());
+                for (; i < j; i++)
+                {
+                    inode_table[locate_inode(nums[i]).second] = inodes[i];
+                    // a cached copy left by the inode freed with this num must not be written back over it
+                    if (_inodes.find(nums[i]) != nullptr)
+                        _inodes.insert(nums[i], inodes[i], false);
+                }
+                _disk.write_block(table_block, mbuf.get());
+            }
+            return nums;
         }
 
         /**
          * @brief Get the free block indexes, and modify the block bitmap. Try to find the consecutive blocks in the same group firstly.
+         * The run starting at goal is taken if it is long enough, otherwise the best-fitting free run (the smallest one holding all
+         * count blocks, nearest to goal on ties). Partial runs, longest first, are only used when no run in the group is long enough,
+         * and the remainder spills over to the following groups.
          *
          * @param group_id
          * @param count
+         * @param goal the preferred first block, e.g. the block after the file's last block. 0 for no preference.
          * @return std::vector<size_t> , if failed , return empty vector.
          */
-        std::vector<uint32_t> ballocs(size_t group_id, size_t count = 1)
+        std::vector<uint32_t> ballocs(size_t group_id, size_t count = 1, uint32_t goal = 0)
         {
-            // For simplicity, just find any free block in any group
             std::vector<uint32_t> ret;
-            for (size_t i = group_id; (i + 1) % full_group_count != group_id; i = (i + 1) % full_group_count)
+            for (size_t k = 0; k < full_group_count and count > 0; k++)
             {
+                size_t i = (group_id + k) % full_group_count;
+                auto &&fs = _free_space[i];
+                if (fs.empty())
+                    continue;
                 size_t group_ind = get_group_index(i);
+                uint32_t _goal = (goal >= group_ind and goal < group_ind + blocks_per_group) ? goal - group_ind : (uint32_t)-1;
+
                 auto &&bitmap = get_block_bitmap(i);
-                bool _bitmap_changed = false;
-                uint32_t start = 0;
-                while (start != (uint32_t)-1)
-                {
-                    start = bitmap.nextBit(start);
-                    if (start != (uint32_t)-1)
+                auto take = [&](uint32_t start, uint32_t len) {
+                    for (uint32_t j = start; j < start + len; j++)
                     {
-                        ret.push_back(start + group_ind);
-                        bitmap.set(start);
-                        _bitmap_changed = true;
-                        count--;
-                        if (count == 0)
-                        {
-                            write_block_bitmap(i, bitmap);
-                            return ret;
-                        }
+                        ret.push_back(j + group_ind);
+                        bitmap.set(j);
                     }
-                }
-                if (_bitmap_changed)
+                    fs.remove(start, len);
+                    count -= len;
+                    account_blocks(i, -(int)len);
+                };
+
+                if (_goal != (uint32_t)-1 and fs.run_at(_goal) >= count)
+                    take(_goal, count);
+                else
                 {
-                    write_block_bitmap(i, bitmap);
+                    // best fit : the smallest run that holds all blocks
+                    auto best = fs.best_fit(count, _goal);
+                    if (best.second != 0)
+                        take(best.first, count);
+                    // partial runs , longest first
+                    while (count > 0 and not fs.empty())
+                    {
+                        auto r = fs.largest();
+                        take(r.first, std::min<size_t>(r.second, count));
+                    }
                 }
+                write_block_bitmap(i, bitmap);
+                // continue the file right after what we got
+                goal = ret.back() + 1;
             }
-            assert(0);
-            return {};
+            assert(count == 0);
+            return ret;
         }
 
         /**
@@ -867,6 +1541,121 @@ namespace Ext2m
             return ballocs(group_id, 1).at(0);
         }
 
+        /**
+         * @brief Get a block for the inode from its reservation window.
+         * When the window is used up, a new one of s_prealloc_blocks (s_prealloc_dir_blocks for directories) blocks is opened right
+         * after the allocated block, so concurrent appenders to different files do not interleave their blocks.
+         *
+         * @param inode_num
+         * @param group_id
+         * @param goal
+         * @param is_dir
+         * @return uint32_t block index
+         */
+        uint32_t balloc_reserved(uint32_t inode_num, size_t group_id, uint32_t goal, bool is_dir)
+        {
+            auto it = _prealloc.find(inode_num);
+            if (it != _prealloc.end())
+            {
+                auto n = it->second.front();
+                it->second.pop_front();
+                if (it->second.empty())
+                    _prealloc.erase(it);
+                use_reserved({n});
+                return n;
+            }
+            auto n = ballocs(group_id, 1, goal).front();
+            auto got = claim_following(n, is_dir ? _superb.s_prealloc_dir_blocks : _superb.s_prealloc_blocks);
+            if (got > 0)
+            {
+                auto &&window = _prealloc[inode_num];
+                for (uint32_t i = 1; i <= got; i++)
+                    window.push_back(n + i);
+            }
+            return n;
+        }
+
+        /**
+         * @brief Reserve the free blocks right after block_idx, stopping at the first used one. They are taken out of the free-extent
+         * index and the free counts only, the block bitmap is left alone, see use_reserved().
+         *
+         * @param block_idx
+         * @param max
+         * @return uint32_t the number of blocks claimed.
+         */
+        uint32_t claim_following(uint32_t block_idx, uint32_t max)
+        {
+            if (max == 0)
+                return 0;
+            auto group_idx = (block_idx - 1) / blocks_per_group;
+            auto offset = (block_idx - 1) % blocks_per_group + 1;
+            if (offset >= blocks_per_group)
+                return 0;
+            uint32_t got = std::min(_free_space[group_idx].run_at(offset), max);
+            if (got == 0)
+                return 0;
+            _free_space[group_idx].remove(offset, got);
+            account_blocks(group_idx, -(int)got);
+            return got;
+        }
+
+        /**
+         * @brief Set the bits of blocks taken from a reservation window in the block bitmaps, once per group.
+         *
+         * @param blocks in order
+         */
+        void use_reserved(const std::vector<uint32_t> &blocks)
+        {
+            size_t k = 0;
+            while (k < blocks.size())
+            {
+                auto group_idx = (blocks[k] - 1) / blocks_per_group;
+                auto &&bitmap = get_block_bitmap(group_idx);
+                for (; k < blocks.size() and (blocks[k] - 1) / blocks_per_group == group_idx; k++)
+                {
+                    assert(not bitmap.get((blocks[k] - 1) % blocks_per_group));
+                    bitmap.set((blocks[k] - 1) % blocks_per_group);
+                }
+                write_block_bitmap(group_idx, bitmap);
+            }
+        }
+
+        /**
+         * @brief Give the unused blocks of the inode's reservation window back to the allocator. Their bits were never set.
+         *
+         * @param inode_num
+         */
+        void discard_prealloc(uint32_t inode_num)
+        {
+            auto it = _prealloc.find(inode_num);
+            if (it == _prealloc.end())
+                return;
+            for (auto &&b : it->second)
+            {
+                auto group_idx = (b - 1) / blocks_per_group;
+                _free_space[group_idx].insert((b - 1) % blocks_per_group, 1);
+                account_blocks(group_idx, 1);
+            }
+            _prealloc.erase(it);
+        }
+
+        /**
+         * @brief Discard the reservation windows of the inodes matching pred.
+         *
+         * @param pred
+         */
+        void discard_prealloc_if(const std::function<bool(uint32_t)> &pred)
+        {
+            std::vector<uint32_t> inodes;
+            for (auto &&i : _prealloc)
+            {
+                if (pred(i.first))
+                    inodes.push_back(i.first);
+            }
+            for (auto &&i : inodes)
+                discard_prealloc(i);
+        }
+
         /**
          * @brief Free a block, and modify the block bitmap.
          *
@@ -881,8 +1670,63 @@ namespace Ext2m
             assert(group_idx < full_group_count);
             assert(offset >= 3 + group_desc_block_count + inodes_table_block_count);
             auto &&bitmap = get_block_bitmap(group_idx);
+            if (not bitmap.get(offset)) // already free
+                return;
             bitmap.reset(offset);
             write_block_bitmap(group_idx, bitmap);
+            _free_space[group_idx].insert(offset, 1);
+            account_blocks(group_idx, 1);
+        }
+
+        /**
+         * @brief Free many blocks, and modify the block bitmaps.
+         * The blocks are sorted by group and each affected bitmap is read and written once, clearing runs of bits at a time.
+         *
+         * @param blocks
+         */
+        void bfrees(std::vector<uint32_t> blocks)
+        {
+            blocks.erase(std::remove(blocks.begin(), blocks.end(), 0u), blocks.end());
+            std::sort(blocks.begin(), blocks.end());
+            blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+            size_t k = 0;
+            while (k < blocks.size())
+            {
+                auto group_idx = (blocks[k] - 1) / blocks_per_group;
+                assert(group_idx < full_group_count);
+                auto group_ind = get_group_index(group_idx);
+                auto &&bitmap = get_block_bitmap(group_idx);
+                auto &&fs = _free_space[group_idx];
+                bool changed = false;
+                while (k < blocks.size() and (blocks[k] - 1) / blocks_per_group == group_idx)
+                {
+                    // a run of consecutive blocks
+                    uint32_t start = blocks[k] - group_ind;
+                    uint32_t len = 1;
+                    while (k + len < blocks.size() and blocks[k + len] == blocks[k] + len and blocks[k + len] - group_ind < blocks_per_group)
+                        len++;
+                    k += len;
+                    assert(start >= group_meta_blocks());
+                    // only the bits still set, the index must not see a block twice
+                    uint32_t pos = start;
+                    while (pos < start + len)
+                    {
+                        auto used = std::min(bitmap.runLength(pos, true), start + len - pos);
+                        if (used == 0)
+                        {
+                            pos++;
+                            continue;
+                        }
+                        bitmap.resetRange(pos, used);
+                        fs.insert(pos, used);
+                        account_blocks(group_idx, used);
+                        changed = true;
+                        pos += used;
+                    }
+                }
+                if (changed)
+                    write_block_bitmap(group_idx, bitmap);
+            }
         }
 
         /**
@@ -895,28 +1739,65 @@ namespace Ext2m
         {
             if (inode_num < _superb.s_first_ino)
                 return;
+            discard_prealloc(inode_num);
+            _extents.erase(inode_num);
+            _dentries.erase_dir(inode_num);
+            _dir_slots.erase(inode_num);
+            _dir_frees.erase(inode_num);
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            bool is_dir = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+
+            // data blocks and the indirect blocks pointing to them, one bitmap update per group
+            std::vector<uint32_t> meta;
+            auto &&all_blocks = get_inode_all_blocks(inode_num, &meta);
+            all_blocks.insert(all_blocks.end(), meta.begin(), meta.end());
+            bfrees(all_blocks);
+
             inode_num--;
             size_t group_index = inode_num / inodes_per_group;
             size_t ind = inode_num % inodes_per_group;
             assert(group_index < full_group_count);
-
-            auto &&all_blocks = get_inode_all_blocks(inode_num);
-            for (auto &&i : all_blocks)
-            {
-                bfree(i);
-            }
             auto &&bm = get_inode_bitmap(group_index);
             bm.reset(ind);
             write_inode_bitmap(group_index, bm);
+            account_inodes(group_index, 1, is_dir);
         }
 
         /**
-         * @brief Write the inode object to the disk.
+         * @brief Write the inode object. It stays dirty in the inode cache until flush_inodes().
          * ! Caution: Not modify the inode bitmap
          * @param inode_num
          * @param inode
          */
         void write_inode(size_t inode_num, const struct ext2_inode &inode)
+        {
+            assert(inode_num >= 1);
+            _inodes.insert(inode_num, inode, true);
+            evict_inodes();
+        }
+
+        /**
+         * @brief Write an inode whose timestamps only changed (lazytime). The inode-table block is left alone until the inode is
+         * written back with its neighbours, synced with its timestamps, or evicted.
+         *
+         * @param inode_num
+         * @param inode
+         */
+        void write_inode_times(size_t inode_num, const struct ext2_inode &inode)
+        {
+            assert(inode_num >= 1);
+            _inodes.insert_lazy(inode_num, inode, time(NULL));
+            evict_inodes();
+        }
+
+        /**
+         * @brief Get the inode-table block holding an inode and the inode's slot in it.
+         *
+         * @param inode_num
+         * @return std::pair<uint32_t, size_t>
+         */
+        std::pair<uint32_t, size_t> locate_inode(size_t inode_num)
         {
             assert(inode_num >= 1);
             inode_num--;
@@ -928,12 +1809,85 @@ namespace Ext2m
             //  BLOCK_SIZE / INODE_SIZE; // 8 inodes per block
             size_t block_index = ind / 8;
             size_t offset = ind % 8;
+            return {inode_table_block_ind + block_index, offset};
+        }
 
-            _disk.read_block(inode_table_block_ind + block_index, _buf);
-            auto *inode_table = (ext2_inode *)_buf;
-            inode_table[offset] = inode;
+        /**
+         * @brief Write the dirty cached inodes back, each inode-table block is read and written once whatever the number of its
+         * dirty inodes. The lazy inodes of a table block being written ride along.
+         *
+         * @param lazy_before the lazy inodes that became lazy before it are written in any case, by default all of them.
+         */
+        void flush_inodes(uint64_t lazy_before = (uint64_t)-1)
+        {
+            if (_inodes.dirty_count() == 0)
+                return;
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            auto *inode_table = (ext2_inode *)mbuf.get();
+            uint32_t table_block = 0;
+            auto &&dirty = _inodes.dirty(lazy_before);
+            if (lazy_before != (uint64_t)-1)
+            {
+                // the other inodes of the table blocks written anyway
+                std::vector<uint32_t> blocks;
+                for (auto &&i : dirty)
+                    blocks.push_back(locate_inode(i.first).first);
+                auto &&lazy = _inodes.dirty((uint64_t)-1);
+                dirty.clear();
+                for (auto &&i : lazy)
+                    if (std::binary_search(blocks.begin(), blocks.end(), locate_inode(i.first).first))
+                        dirty.push_back(i);
+            }
+            for (auto &&i : dirty)
+            {
+                auto loc = locate_inode(i.first);
+                if (loc.first != table_block)
+                {
+                    if (table_block != 0)
+                        _disk.write_block(table_block, mbuf.get());
+                    table_block = loc.first;
+                    _disk.read_block(table_block, mbuf.get());
+                }
+                inode_table[loc.second] = *i.second;
+            }
+            if (table_block != 0)
+                _disk.write_block(table_block, mbuf.get());
+            for (auto &&i : dirty)
+                _inodes.clean(i.first);
+        }
+
+        /**
+         * @brief Keep the inode cache within its capacity, the dirty inodes are written back first if they are in the way.
+         */
+        void evict_inodes()
+        {
+            if (not _inodes.full())
+                return;
+            _inodes.shrink();
+            if (_inodes.full())
+            {
+                flush_inodes();
+                _inodes.shrink();
+            }
+        }
+
+        /**
+         * @brief Keep an inode cached until iput(), e.g. while a file is open.
+         *
+         * @param inode_num
+         */
+        void iget(size_t inode_num)
+        {
+            if (_inodes.find(inode_num) == nullptr)
+                _inodes.insert(inode_num, read_inode(inode_num), false);
+            _inodes.hold(inode_num);
+            evict_inodes();
+        }
 
-            _disk.write_block(inode_table_block_ind + block_index, _buf);
+        void iput(size_t inode_num)
+        {
+            _inodes.put(inode_num);
+            evict_inodes();
         }
 
         void init_entry_block(void *_block, uint32_t inode_num, uint32_t father_inode_num)
@@ -957,185 +1911,2178 @@ namespace Ext2m
             _start->rec_len = BLOCK_SIZE - 12;
         }
 
+        /*
+         * Hashed directory index (htree), as in ext3 : a directory outgrowing its first block becomes a tree keyed by the hash of
+         * the names, with one or two levels of index nodes above the leaves. Block 0 keeps "." and ".." and the root of the index
+         * hidden behind the rec_len of "..", an index node holds one unused entry spanning the block, so a linear reader sees only
+         * the entries of the leaves. A leaf is an ordinary entry block holding the names of a hash range.
+         */
+
+        static constexpr size_t DX_ROOT_OFFSET = 24; // after "." and ".."
+        static constexpr uint16_t DX_ROOT_LIMIT = (BLOCK_SIZE - DX_ROOT_OFFSET - sizeof(ext2_dx_root_info)) / sizeof(ext2_dx_entry);
+        static constexpr uint16_t DX_NODE_LIMIT = (BLOCK_SIZE - sizeof(ext2_dir_entry_2)) / sizeof(ext2_dx_entry);
+
+        static bool is_indexed_dir(const ext2_inode &inode) { return inode.i_flags & EXT2_INDEX_FL; }
+        static ext2_dx_root_info *dx_info(uint8_t *root) { return (ext2_dx_root_info *)(root + DX_ROOT_OFFSET); }
+        static ext2_dx_entry *dx_entries(uint8_t *node, bool is_root)
+        {
+            return (ext2_dx_entry *)(node + (is_root ? DX_ROOT_OFFSET + sizeof(ext2_dx_root_info) : sizeof(ext2_dir_entry_2)));
+        }
+        static ext2_dx_countlimit *dx_countlimit(ext2_dx_entry *entries) { return (ext2_dx_countlimit *)entries; }
+
+        bool dir_index_enabled() const { return _superb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX; }
+
+        // blocks the allocator can hand out, those of the reservation windows are not counted
+        uint32_t free_blocks_count() const { return _superb.s_free_blocks_count; }
+
+        /**
+         * @brief Turn on DIR_INDEX for an image formatted without it, its directories are indexed from now on as they grow.
+         */
+        void enable_dir_index()
+        {
+            if (dir_index_enabled())
+                return;
+            _superb.s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+            init_hash_seed(_superb);
+        }
+
         /**
-         * @brief Add an entry to the inode.
+         * @brief Pick the hash of the directory indexes and a random seed for it.
          *
-         * @param inode_num
-         * @param ent
+         * @param sb
          */
-        void add_entry_to_inode(uint32_t inode_num, const entry &ent)
+        static void init_hash_seed(ext2_super_block &sb)
         {
-            assert(ent.name.size() <= EXT2_NAME_LEN);
-            auto &&all_blocks = get_inode_all_blocks(inode_num);
-            for (auto &&i : all_blocks)
-            {
-                _disk.read_block(i, _buf);
-                entry_block eb(_buf);
-                if (eb.add_entry(ent))
-                {
-                    _disk.write_block(i, _buf);
-                    return;
-                }
-            }
-            auto n = add_block_to_inode(inode_num);
-            assert(n != (uint32_t)-1);
-            init_entry_block(_buf, inode_num, get_father_inode_num(inode_num));
-            entry_block eb(_buf);
-            bool flag = eb.add_entry(ent);
-            assert(flag);
-            _disk.write_block(n, _buf);
+            std::random_device rd;
+            for (size_t i = 0; i < 4; i++)
+                sb.s_hash_seed[i] = rd();
+            sb.s_def_hash_version = EXT2_DX_HASH_TEA;
         }
+
         /**
-         * @brief Get the inode object with its inode num.
-         * ! Caution: Not modify the inode bitmap
-         * @param inode_num
-         * @param inode
+         * @brief Fill a block with one unused entry, an empty leaf or the header of an index node.
+         *
+         * @param block
          */
-        void get_inode(size_t inode_num, struct ext2_inode &inode)
+        static void init_empty_entry_block(uint8_t *block)
         {
-            assert(inode_num >= 1);
-            inode_num--;
-            size_t group_index = inode_num / inodes_per_group;
-            size_t ind = inode_num % inodes_per_group;
-            assert(group_index < full_group_count);
-            auto inode_table_block_ind = get_inode_table_index(group_index);
+            memset(block, 0, BLOCK_SIZE);
+            ((ext2_dir_entry_2 *)block)->rec_len = BLOCK_SIZE;
+        }
 
-            //     BLOCK_SIZE / INODE_SIZE; // 8 inodes per block
-            size_t block_index = ind / 8;
-            size_t offset = ind % 8;
+        static uint32_t dx_hack_hash(const char *name, size_t len)
+        {
+            uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+            while (len--)
+            {
+                uint32_t hash = hash1 + (hash0 ^ (*name++ * 7152373));
+                if (hash & 0x80000000)
+                    hash -= 0x7fffffff;
+                hash1 = hash0;
+                hash0 = hash;
+            }
+            return hash0 << 1;
+        }
 
-            _disk.read_block(inode_table_block_ind + block_index, _buf);
-            auto *inode_table = (ext2_inode *)_buf;
-            inode = inode_table[offset];
+        static void tea_transform(uint32_t buf[4], const uint32_t in[4])
+        {
+            uint32_t sum = 0;
+            uint32_t b0 = buf[0], b1 = buf[1];
+            for (int n = 0; n < 16; n++)
+            {
+                sum += 0x9E3779B9;
+                b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+                b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+            }
+            buf[0] += b0;
+            buf[1] += b1;
         }
 
         /**
-         * @brief Free an entry of the inode.
-         *
-         * @param inode_num the directory inode.
-         * @param free_inode the inode to be freed.
+         * @brief Pack up to num * 4 bytes of a name into num words, padded with its length.
          */
-        void free_entry_to_inode(uint32_t inode_num, uint32_t free_inode)
+        static void str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num)
         {
-            auto &&all_blocks = get_inode_all_blocks(inode_num);
-            for (auto &&i : all_blocks)
+            uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+            pad |= pad << 16;
+            uint32_t val = pad;
+            len = std::min<size_t>(len, num * 4);
+            for (size_t i = 0; i < len; i++)
             {
-                _disk.read_block(i, _buf);
-                entry_block eb(_buf);
-                if (eb.free(free_inode))
+                val = (uint8_t)msg[i] + (val << 8);
+                if (i % 4 == 3)
                 {
-                    _disk.write_block(i, _buf);
-                    return;
+                    *buf++ = val;
+                    val = pad;
+                    num--;
                 }
             }
-            assert(0);
+            if (--num >= 0)
+                *buf++ = val;
+            while (--num >= 0)
+                *buf++ = pad;
         }
 
         /**
-         * @brief Get all blocks belongs to an inode.
+         * @brief Hash a name for the directory index, the low bit is always clear.
          *
-         * @param inode_num
-         * @return std::vector<uint32_t> blocks indexes.
+         * @param name
+         * @param version EXT2_DX_HASH_TEA (seeded with s_hash_seed) or EXT2_DX_HASH_LEGACY
+         * @return uint32_t
          */
-        std::vector<uint32_t> get_inode_all_blocks(size_t inode_num)
+        uint32_t dx_hash(const std::string &name, uint8_t version) const { return dx_hash(name.data(), name.size(), version); }
+
+        uint32_t dx_hash(const char *name, size_t len, uint8_t version) const
         {
-            ext2_inode inode;
-            get_inode(inode_num, inode);
-            bool flag = true;
-            std::vector<uint32_t> indexs;
-            for (int i = 0; i < EXT2_N_BLOCKS; i++)
+            uint32_t hash;
+            if (version == EXT2_DX_HASH_TEA)
             {
-                auto n = inode.i_block[i];
-                if (i < EXT2_DIRECT_BLOCKS) // direct access block
-                {
-                    flag &= __get_inode_all_blocks__(n, 0, indexs);
-                }
-                else if (i == EXT2_INDIRECT_BLOCK) // the first indirect block
-                {
-                    flag &= __get_inode_all_blocks__(n, 1, indexs);
-                }
-                else if (i == EXT2_DOUBLY_INDIRECT_BLOCK) // the second indirect block
+                uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+                if (_superb.s_hash_seed[0] or _superb.s_hash_seed[1] or _superb.s_hash_seed[2] or _superb.s_hash_seed[3])
+                    memcpy(buf, _superb.s_hash_seed, sizeof(buf));
+                uint32_t in[4];
+                for (size_t p = 0; p < len; p += 16)
                 {
-                    flag &= __get_inode_all_blocks__(n, 2, indexs);
+                    str2hashbuf(name + p, len - p, in, 4);
+                    tea_transform(buf, in);
                 }
-                else if (i == EXT2_TRIPLY_INDIRECT_BLOCK) // the third indirect block
-                {
-                    flag &= __get_inode_all_blocks__(n, 3, indexs);
-                }
-                else
-                {
-                    assert(0);
-                }
-                if (not flag)
-                    break;
+                hash = buf[0];
             }
-            return indexs;
+            else
+                hash = dx_hack_hash(name, len);
+            hash &= ~1u;
+            if (hash == (EXT2_HTREE_EOF << 1))
+                hash = (EXT2_HTREE_EOF - 1) << 1;
+            return hash;
+        }
+
+        // an index node on the path from the root to a leaf
+        struct dx_frame
+        {
+            uint32_t lblock;
+            std::unique_ptr<uint8_t[]> node;
+            ext2_dx_entry *entries;
+            ext2_dx_entry *at; // the entry followed
+        };
+
+        void dx_read_frame(uint32_t inode_num, uint32_t lblock, bool is_root, dx_frame &f)
+        {
+            f.lblock = lblock;
+            f.node.reset(new uint8_t[BLOCK_SIZE]);
+            _disk.read_block(bmap(inode_num, lblock), f.node.get());
+            f.entries = dx_entries(f.node.get(), is_root);
+            f.at = f.entries;
         }
 
+        void dx_write_frame(uint32_t inode_num, const dx_frame &f) { _disk.write_block(bmap(inode_num, f.lblock), f.node.get()); }
+
         /**
-         * @brief Add a block to an inode.
+         * @brief Walk the index of a directory down to the first leaf that may hold a name.
          *
          * @param inode_num
-         * @return uint32_t
+         * @param name
+         * @param frames the path, root first
+         * @param hash the hash of the name
+         * @return uint32_t the logical block of the leaf.
          */
-        uint32_t add_block_to_inode(size_t inode_num)
+        uint32_t dx_probe(uint32_t inode_num, const std::string &name, std::vector<dx_frame> &frames, uint32_t &hash)
         {
-            size_t group_index = inode_num / inodes_per_group;
+            return dx_probe(inode_num, &name, frames, hash);
+        }
 
-            ext2_inode inode;
+        /**
+         * @brief Walk the index of a directory down to the first leaf that may hold a name, or a hash.
+         *
+         * @param inode_num
+         * @param name nullptr to look the hash up
+         * @param frames the path, root first
+         * @param hash the hash looked up, set to the hash of the name if any
+         * @return uint32_t the logical block of the leaf.
+         */
+        uint32_t dx_probe(uint32_t inode_num, const std::string *name, std::vector<dx_frame> &frames, uint32_t &hash)
+        {
+            frames.clear();
+            frames.emplace_back();
+            dx_read_frame(inode_num, 0, true, frames[0]);
+            auto *info = dx_info(frames[0].node.get());
+            assert(info->reserved_zero == 0 and info->info_length == sizeof(ext2_dx_root_info) and info->indirect_levels <= 1);
+            if (name != nullptr)
+                hash = dx_hash(*name, info->hash_version);
+            for (int level = 0;; level++)
+            {
+                auto &&f = frames.back();
+                auto count = dx_countlimit(f.entries)->count;
+                // the last entry not above hash, the first one has no hash and covers from 0
+                f.at = std::upper_bound(f.entries + 1, f.entries + count, hash,
+                                        [](uint32_t h, const ext2_dx_entry &e) { return h < e.hash; }) -
+                       1;
+                uint32_t child = f.at->block;
+                if (level == info->indirect_levels)
+                    return child;
+                frames.emplace_back();
+                dx_read_frame(inode_num, child, false, frames.back());
+            }
+        }
+
+        /**
+         * @brief Move the frames to the next leaf in hash order.
+         *
+         * @param inode_num
+         * @param frames
+         * @param lblock the logical block of the leaf
+         * @param start_hash the lowest hash of the leaf, with the continuation bit
+         * @return false at the end of the index.
+         */
+        bool dx_next(uint32_t inode_num, std::vector<dx_frame> &frames, uint32_t &lblock, uint32_t &start_hash)
+        {
+            int level = frames.size() - 1;
+            while (level >= 0 and frames[level].at + 1 == frames[level].entries + dx_countlimit(frames[level].entries)->count)
+                level--;
+            if (level < 0)
+                return false;
+            frames[level].at++;
+            start_hash = frames[level].at->hash;
+            for (size_t l = level + 1; l < frames.size(); l++)
+                dx_read_frame(inode_num, frames[l - 1].at->block, false, frames[l]);
+            lblock = frames.back().at->block;
+            return true;
+        }
+
+        /**
+         * @brief Find a name in an indexed directory, as dx_probe() and dx_next() do but with the index nodes and the leaves read
+         * in place from the cache, nothing is copied or allocated.
+         *
+         * @param inode_num
+         * @param name not null terminated
+         * @param len
+         * @return ssize_t the inode of the name, -1 if not found.
+         */
+        ssize_t dx_find(uint32_t inode_num, const char *name, size_t len)
+        {
+            // the root, and the index node below it if any
+            struct
+            {
+                uint32_t block;
+                ext2_dx_entry *entries, *at;
+            } path[2];
+            path[0].block = bmap(inode_num, 0);
+            auto *root = (uint8_t *)_disk.pin(path[0].block);
+            auto *info = dx_info(root);
+            assert(info->reserved_zero == 0 and info->info_length == sizeof(ext2_dx_root_info) and info->indirect_levels <= 1);
+            int depth = info->indirect_levels + 1;
+            uint32_t hash = dx_hash(name, len, info->hash_version);
+            path[0].entries = dx_entries(root, true);
+            for (int level = 0;; level++)
+            {
+                auto &&f = path[level];
+                f.at = std::upper_bound(f.entries + 1, f.entries + dx_countlimit(f.entries)->count, hash,
+                                        [](uint32_t h, const ext2_dx_entry &e) { return h < e.hash; }) -
+                       1;
+                if (level + 1 == depth)
+                    break;
+                path[level + 1].block = bmap(inode_num, f.at->block);
+                path[level + 1].entries = dx_entries((uint8_t *)_disk.pin(path[level + 1].block), false);
+            }
+            ssize_t ret = -1;
+            for (;;)
+            {
+                auto leaf = bmap(inode_num, path[depth - 1].at->block);
+                ret = entry_block::find(_disk.pin(leaf), name, len);
+                _disk.unpin(leaf);
+                if (ret != -1)
+                    break;
+                // the next leaf holds the same names only if it starts with the hash, a collision
+                int level = depth - 1;
+                while (level >= 0 and path[level].at + 1 == path[level].entries + dx_countlimit(path[level].entries)->count)
+                    level--;
+                if (level < 0 or (path[level].at[1].hash & ~1u) != hash)
+                    break;
+                path[level].at++;
+                if (level + 1 < depth)
+                {
+                    _disk.unpin(path[1].block);
+                    path[1].block = bmap(inode_num, path[0].at->block);
+                    path[1].entries = dx_entries((uint8_t *)_disk.pin(path[1].block), false);
+                    path[1].at = path[1].entries;
+                }
+            }
+            for (int level = 0; level < depth; level++)
+                _disk.unpin(path[level].block);
+            return ret;
+        }
+
+        /**
+         * @brief Add a logical block to a directory.
+         *
+         * @param inode_num
+         * @return uint32_t the logical block.
+         */
+        uint32_t dx_new_block(uint32_t inode_num)
+        {
+            auto n = add_block_to_inode(inode_num);
+            assert(n != (uint32_t)-1);
+            return get_block_count(inode_num) - 1;
+        }
+
+        /**
+         * @brief Add an entry to the index node at the bottom of the frames, right after the entry followed. A full node is split,
+         * a full root moves its entries one level down.
+         *
+         * @param inode_num
+         * @param frames
+         * @param hash
+         * @param lblock
+         */
+        void dx_insert(uint32_t inode_num, std::vector<dx_frame> &frames, uint32_t hash, uint32_t lblock)
+        {
+            auto *cl = dx_countlimit(frames.back().entries);
+            if (cl->count == cl->limit)
+            {
+                auto &&root = frames[0];
+                auto *root_cl = dx_countlimit(root.entries);
+                dx_frame node;
+                dx_read_frame(inode_num, dx_new_block(inode_num), false, node);
+                init_empty_entry_block(node.node.get());
+                if (frames.size() == 1)
+                {
+                    // the entries of the root move to a new node one level down
+                    memcpy(node.entries, root.entries, root_cl->count * sizeof(ext2_dx_entry));
+                    dx_countlimit(node.entries)->limit = DX_NODE_LIMIT;
+                    node.at = node.entries + (root.at - root.entries);
+                    root_cl->count = 1;
+                    root.entries[0].block = node.lblock;
+                    root.at = root.entries;
+                    dx_info(root.node.get())->indirect_levels = 1;
+                }
+                else
+                {
+                    // the upper half of the node moves to a new node, indexed by the root
+                    assert(root_cl->count < root_cl->limit);
+                    auto &&old = frames[1];
+                    uint16_t half = cl->count / 2;
+                    uint32_t hash2 = old.entries[half].hash;
+                    memcpy(node.entries, old.entries + half, (cl->count - half) * sizeof(ext2_dx_entry));
+                    dx_countlimit(node.entries)->count = cl->count - half;
+                    dx_countlimit(node.entries)->limit = DX_NODE_LIMIT;
+                    cl->count = half;
+                    memmove(root.at + 2, root.at + 1, (root.entries + root_cl->count - (root.at + 1)) * sizeof(ext2_dx_entry));
+                    root.at[1] = {hash2, node.lblock};
+                    root_cl->count++;
+                    if (old.at < old.entries + half)
+                    {
+                        dx_write_frame(inode_num, node);
+                        node = std::move(old);
+                    }
+                    else
+                    {
+                        node.at = node.entries + (old.at - old.entries - half);
+                        root.at++;
+                        dx_write_frame(inode_num, old);
+                    }
+                    frames.pop_back();
+                }
+                dx_write_frame(inode_num, root);
+                frames.push_back(std::move(node));
+                cl = dx_countlimit(frames.back().entries);
+            }
+            auto &&f = frames.back();
+            memmove(f.at + 2, f.at + 1, (f.entries + cl->count - (f.at + 1)) * sizeof(ext2_dx_entry));
+            f.at[1] = {hash, lblock};
+            cl->count++;
+            dx_write_frame(inode_num, f);
+        }
+
+        /**
+         * @brief Move the upper half (by hash) of a full leaf to a new leaf, indexed right after it.
+         *
+         * @param inode_num
+         * @param frames the path to the leaf
+         * @param leaf
+         */
+        void dx_split_leaf(uint32_t inode_num, std::vector<dx_frame> &frames, uint32_t leaf)
+        {
+            auto version = dx_info(frames[0].node.get())->hash_version;
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            _disk.read_block(bmap(inode_num, leaf), mbuf.get());
+            std::vector<std::pair<uint32_t, entry>> ents;
+            entry_block eb(mbuf.get());
+            entry e;
+            size_t total = 0;
+            while (eb.next_entry(e))
+            {
+                total += roundup(e.name.size() + 1 + sizeof(ext2_dir_entry_2), 4);
+                ents.emplace_back(dx_hash(e.name, version), e);
+            }
+            assert(ents.size() >= 2);
+            std::stable_sort(ents.begin(), ents.end(), [](const std::pair<uint32_t, entry> &a, const std::pair<uint32_t, entry> &b) {
+                return a.first < b.first;
+            });
+            // half of the used space each
+            size_t m = 0;
+            for (size_t used = 0; m + 1 < ents.size() and used < total / 2; m++)
+                used += roundup(ents[m].second.name.size() + 1 + sizeof(ext2_dir_entry_2), 4);
+            m = std::max<size_t>(m, 1);
+            uint32_t hash2 = ents[m].first | (ents[m].first == ents[m - 1].first ? 1 : 0);
+
+            auto new_leaf = dx_new_block(inode_num);
+            std::unique_ptr<uint8_t[]> nbuf(new uint8_t[BLOCK_SIZE]);
+            init_empty_entry_block(mbuf.get());
+            init_empty_entry_block(nbuf.get());
+            entry_block low(mbuf.get()), high(nbuf.get());
+            for (size_t i = 0; i < ents.size(); i++)
+            {
+                bool ok = (i < m ? low : high).add_entry(ents[i].second);
+                assert(ok);
+            }
+            _disk.write_block(bmap(inode_num, leaf), mbuf.get());
+            _disk.write_block(bmap(inode_num, new_leaf), nbuf.get());
+            dx_insert(inode_num, frames, hash2, new_leaf);
+        }
+
+        /**
+         * @brief Add an entry to an indexed directory, splitting its leaf if full.
+         *
+         * @param inode_num
+         * @param ent
+         */
+        void dx_add_entry(uint32_t inode_num, const entry &ent)
+        {
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            std::vector<dx_frame> frames;
+            uint32_t hash;
+            while (true)
+            {
+                auto leaf = dx_probe(inode_num, ent.name, frames, hash);
+                auto block = bmap(inode_num, leaf);
+                _disk.read_block(block, mbuf.get());
+                entry_block eb(mbuf.get());
+                if (eb.add_entry(ent))
+                {
+                    _disk.write_block(block, mbuf.get());
+                    return;
+                }
+                dx_split_leaf(inode_num, frames, leaf);
+            }
+        }
+
+        /**
+         * @brief Turn a directory of one full block into an indexed one : block 0 becomes the root, its entries move to leaves.
+         *
+         * @param inode_num
+         */
+        void dx_make_indexed(uint32_t inode_num)
+        {
+            std::unique_ptr<uint8_t[]> root(new uint8_t[BLOCK_SIZE]);
+            auto root_block = bmap(inode_num, 0);
+            _disk.read_block(root_block, root.get());
+            std::vector<entry> ents;
+            uint32_t father_inode_num = inode_num;
+            entry_block eb(root.get());
+            entry e;
+            while (eb.next_entry(e))
+            {
+                if (e.name == "..")
+                    father_inode_num = e.inode;
+                else if (e.name != ".")
+                    ents.push_back(e);
+            }
+
+            auto leaf = dx_new_block(inode_num);
+            assert(leaf == 1);
+            init_empty_entry_block(_buf);
+            _disk.write_block(bmap(inode_num, leaf), _buf);
+
+            init_entry_block(root.get(), inode_num, father_inode_num);
+            auto *info = dx_info(root.get());
+            info->reserved_zero = 0;
+            info->hash_version = _superb.s_def_hash_version;
+            info->info_length = sizeof(ext2_dx_root_info);
+            info->indirect_levels = 0;
+            info->unused_flags = 0;
+            auto *entries = dx_entries(root.get(), true);
+            dx_countlimit(entries)->limit = DX_ROOT_LIMIT;
+            dx_countlimit(entries)->count = 1;
+            entries[0].block = leaf;
+            _disk.write_block(root_block, root.get());
+
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            inode.i_flags |= EXT2_INDEX_FL;
+            write_inode(inode_num, inode);
+            for (auto &&i : ents)
+                dx_add_entry(inode_num, i);
+        }
+
+        /**
+         * @brief Find the inode of a name in a directory. A name looked up before, found or not, is answered by the dentry cache
+         * without reading the directory. Nothing is allocated but to cache a name.
+         *
+         * @param inode_num the directory inode.
+         * @param name not null terminated
+         * @param len
+         * @return ssize_t -1 if not found, or if inode_num is not a directory.
+         */
+        ssize_t find_entry(uint32_t inode_num, const char *name, size_t len)
+        {
+            uint32_t cached;
+            if (_dentries.find(inode_num, name, len, cached))
+                return cached == DentryCache::negative ? -1 : (ssize_t)cached;
+            // the data of a file is not entries, nor is anything cached under it
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR)
+                return -1;
+            auto ret = read_entry(inode_num, name, len);
+            _dentries.insert(inode_num, std::string(name, len), ret == -1 ? DentryCache::negative : ret);
+            return ret;
+        }
+
+        ssize_t find_entry(uint32_t inode_num, const std::string &name) { return find_entry(inode_num, name.data(), name.size()); }
+
+        /**
+         * @brief Find the inode of a name in the directory blocks, read in place from the cache. An indexed directory reads its
+         * index path and the leaf of the name's hash, a linear one is scanned block by block.
+         *
+         * @param inode_num the directory inode.
+         * @param name not null terminated
+         * @param len
+         * @return ssize_t -1 if not found.
+         */
+        ssize_t read_entry(uint32_t inode_num, const char *name, size_t len)
+        {
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            bool dots = (len == 1 and name[0] == '.') or (len == 2 and name[0] == '.' and name[1] == '.');
+            if (is_indexed_dir(inode) and not dots)
+                return dx_find(inode_num, name, len);
+            for (uint64_t l = 0;; l++)
+            {
+                auto block = bmap(inode_num, l);
+                if (block == EXT2M_I_BLOCK_END)
+                    return -1;
+                if (block == EXT2M_I_BLOCK_SPARSE)
+                    continue;
+                auto ret = entry_block::find(_disk.pin(block), name, len);
+                _disk.unpin(block);
+                if (ret != -1)
+                    return ret;
+            }
+        }
+
+        /**
+         * @brief Add an entry to the inode. A directory filling its first block gets indexed.
+         *
+         * @param inode_num
+         * @param ent
+         */
+        void add_entry_to_inode(uint32_t inode_num, const entry &ent)
+        {
+            assert(ent.name.size() <= EXT2_NAME_LEN);
+            _dentries.insert(inode_num, ent.name, ent.inode);
+            _dir_version++;
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            if (is_indexed_dir(inode))
+                return dx_add_entry(inode_num, ent);
+            auto need = entry_block::entry_size(ent.name.size());
+            auto &&slots = dir_slots(inode_num);
+            for (size_t l = 0; l < slots.size(); l++)
+            {
+                if (slots[l] < need)
+                    continue;
+                auto block = bmap(inode_num, l);
+                _disk.read_block(block, _buf);
+                entry_block eb(_buf);
+                bool flag = eb.add_entry(ent);
+                assert(flag);
+                slots[l] = eb.largest_free();
+                _disk.write_block(block, _buf);
+                return;
+            }
+            if (dir_index_enabled() and slots.size() == 1)
+            {
+                _dir_slots.erase(inode_num);
+                dx_make_indexed(inode_num);
+                return dx_add_entry(inode_num, ent);
+            }
+            auto n = add_block_to_inode(inode_num);
+            assert(n != (uint32_t)-1);
+            init_entry_block(_buf, inode_num, get_father_inode_num(inode_num));
+            entry_block eb(_buf);
+            bool flag = eb.add_entry(ent);
+            assert(flag);
+            slots.push_back(eb.largest_free());
+            _disk.write_block(n, _buf);
+        }
+
+        /**
+         * @brief Add many entries to a directory at once, none of their names being in it already. A linear directory takes them in
+         * order in the blocks with room, then in new blocks appended together, each block is read and written once. An indexed
+         * directory takes them in hash order, each leaf is read and written once per run of entries falling in it.
+         *
+         * @param inode_num
+         * @param ents
+         */
+        void add_entries_to_inode(uint32_t inode_num, const std::vector<entry> &ents)
+        {
+            // some names may be cached as missing
+            _dentries.erase_dir(inode_num);
+            _dir_version++;
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            size_t i = 0;
+            if (not is_indexed_dir(inode))
+            {
+                auto &&slots = dir_slots(inode_num);
+                for (size_t l = 0; l < slots.size() and i < ents.size(); l++)
+                {
+                    if (slots[l] < entry_block::entry_size(ents[i].name.size()))
+                        continue;
+                    auto block = bmap(inode_num, l);
+                    _disk.read_block(block, mbuf.get());
+                    entry_block eb(mbuf.get());
+                    while (i < ents.size() and eb.add_entry(ents[i]))
+                        i++;
+                    slots[l] = eb.largest_free();
+                    _disk.write_block(block, mbuf.get());
+                }
+                if (i == ents.size())
+                    return;
+                if (not dir_index_enabled() or slots.size() > 1)
+                {
+                    // the others packed in new blocks
+                    auto father_inode_num = get_father_inode_num(inode_num);
+                    std::vector<std::unique_ptr<uint8_t[]>> bufs;
+                    while (i < ents.size())
+                    {
+                        bufs.emplace_back(new uint8_t[BLOCK_SIZE]);
+                        init_entry_block(bufs.back().get(), inode_num, father_inode_num);
+                        entry_block eb(bufs.back().get());
+                        while (i < ents.size() and eb.add_entry(ents[i]))
+                            i++;
+                        slots.push_back(eb.largest_free());
+                    }
+                    auto &&blocks = add_blocks_to_inode(inode_num, bufs.size());
+                    assert(blocks.size() == bufs.size());
+                    for (size_t k = 0; k < blocks.size(); k++)
+                        _disk.write_block(blocks[k], bufs[k].get());
+                    return;
+                }
+                _dir_slots.erase(inode_num);
+                dx_make_indexed(inode_num);
+            }
+
+            std::vector<dx_frame> frames;
+            uint32_t hash = 0;
+            dx_probe(inode_num, nullptr, frames, hash);
+            auto version = dx_info(frames[0].node.get())->hash_version;
+            std::vector<std::pair<uint32_t, size_t>> order;
+            for (size_t k = i; k < ents.size(); k++)
+                order.emplace_back(dx_hash(ents[k].name, version), k);
+            std::sort(order.begin(), order.end());
+            for (size_t k = 0; k < order.size();)
+            {
+                hash = order[k].first;
+                auto leaf = dx_probe(inode_num, nullptr, frames, hash);
+                // the hashes below the next index entry of any level go to this leaf
+                uint64_t end = (uint64_t)1 << 32;
+                for (auto &&f : frames)
+                {
+                    if (f.at + 1 != f.entries + dx_countlimit(f.entries)->count)
+                        end = std::min<uint64_t>(end, (f.at + 1)->hash);
+                }
+                auto block = bmap(inode_num, leaf);
+                _disk.read_block(block, mbuf.get());
+                entry_block eb(mbuf.get());
+                size_t first = k;
+                while (k < order.size() and order[k].first < end and eb.add_entry(ents[order[k].second]))
+                    k++;
+                if (k != first)
+                    _disk.write_block(block, mbuf.get());
+                if (k < order.size() and order[k].first < end)
+                    dx_split_leaf(inode_num, frames, leaf);
+            }
+        }
+
+        /**
+         * @brief Get the largest free slot of each block of a linear directory, each block is read once the first time.
+         *
+         * @param inode_num
+         * @return std::vector<uint16_t>& indexed by logical block, 0 for a hole.
+         */
+        std::vector<uint16_t> &dir_slots(uint32_t inode_num)
+        {
+            auto it = _dir_slots.find(inode_num);
+            if (it != _dir_slots.end())
+                return it->second;
+            if (_dir_slots.size() >= DIR_HINTS_CAPACITY)
+                _dir_slots.erase(_dir_slots.begin());
+            auto &&slots = _dir_slots[inode_num];
+            for (auto &&b : bmaps(inode_num, 0, get_block_count(inode_num)))
+            {
+                if (b == EXT2M_I_BLOCK_SPARSE)
+                {
+                    slots.push_back(0);
+                    continue;
+                }
+                _disk.read_block(b, _buf);
+                slots.push_back(entry_block(_buf).largest_free());
+            }
+            return slots;
+        }
+
+        /**
+         * @brief Compact a directory. The entries of the last blocks of a linear directory move to the free slots of the first
+         * ones while they fit, the trailing blocks left empty are freed, and every block left is packed. The leaves of an indexed
+         * directory are packed in place, and once its entries fit in half of the first block it becomes linear again, all its
+         * other blocks are freed.
+         *
+         * @param inode_num
+         */
+        void compact_dir(uint32_t inode_num)
+        {
+            _dir_frees.erase(inode_num);
+            _dir_version++;
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            if (is_indexed_dir(inode))
+            {
+                // half of the first block, so that it does not get indexed again right away
+                const size_t room = (BLOCK_SIZE - DX_ROOT_OFFSET) / 2;
+                size_t used = 0;
+                std::vector<entry> ents;
+                std::vector<dx_frame> frames;
+                uint32_t hash = 0, start;
+                auto leaf = dx_probe(inode_num, nullptr, frames, hash);
+                do
+                {
+                    auto block = bmap(inode_num, leaf);
+                    _disk.read_block(block, mbuf.get());
+                    entry_block eb(mbuf.get());
+                    if (eb.compact())
+                        _disk.write_block(block, mbuf.get());
+                    entry e;
+                    while (used <= room and eb.next_entry(e))
+                    {
+                        used += entry_block::entry_size(e.name.size());
+                        ents.push_back(e);
+                    }
+                } while (dx_next(inode_num, frames, leaf, start));
+                if (used > room)
+                    return;
+                auto root_block = bmap(inode_num, 0);
+                init_entry_block(mbuf.get(), inode_num, get_father_inode_num(inode_num));
+                entry_block eb(mbuf.get());
+                for (auto &&e : ents)
+                {
+                    bool flag = eb.add_entry(e);
+                    assert(flag);
+                }
+                _disk.write_block(root_block, mbuf.get());
+                get_inode(inode_num, inode);
+                inode.i_flags &= ~EXT2_INDEX_FL;
+                write_inode(inode_num, inode);
+                truncate_blocks(inode_num, 1);
+                _dir_slots[inode_num] = {eb.largest_free()};
+                return;
+            }
+            auto &&blocks = bmaps(inode_num, 0, get_block_count(inode_num));
+            // once packed, the free space of a block is one slot at its end, an added entry takes exactly its size of it
+            std::vector<uint16_t> slots;
+            for (auto &&b : blocks)
+            {
+                if (b == EXT2M_I_BLOCK_SPARSE)
+                {
+                    slots.push_back(0);
+                    continue;
+                }
+                _disk.read_block(b, mbuf.get());
+                entry_block eb(mbuf.get());
+                if (eb.compact())
+                    _disk.write_block(b, mbuf.get());
+                slots.push_back(eb.largest_free());
+            }
+            size_t keep = blocks.size();
+            while (keep > 1)
+            {
+                std::vector<entry> ents;
+                if (blocks[keep - 1] != EXT2M_I_BLOCK_SPARSE)
+                {
+                    _disk.read_block(blocks[keep - 1], mbuf.get());
+                    entry_block eb(mbuf.get());
+                    entry e;
+                    while (eb.next_entry(e))
+                        if (e.name != "." and e.name != "..")
+                            ents.push_back(e);
+                }
+                // first fit into the blocks before, as add_entry_to_inode() does
+                auto fit = slots;
+                std::vector<size_t> target;
+                for (auto &&e : ents)
+                {
+                    auto need = entry_block::entry_size(e.name.size());
+                    size_t l = 0;
+                    while (l < keep - 1 and fit[l] < need)
+                        l++;
+                    if (l == keep - 1)
+                        break;
+                    fit[l] -= need;
+                    target.push_back(l);
+                }
+                if (target.size() < ents.size())
+                    break;
+                for (size_t i = 0; i < ents.size(); i++)
+                {
+                    _disk.read_block(blocks[target[i]], mbuf.get());
+                    bool flag = entry_block(mbuf.get()).add_entry(ents[i]);
+                    assert(flag);
+                    _disk.write_block(blocks[target[i]], mbuf.get());
+                }
+                slots = std::move(fit);
+                keep--;
+            }
+            if (keep < blocks.size())
+                truncate_blocks(inode_num, keep);
+            slots.resize(keep);
+            _dir_slots[inode_num] = std::move(slots);
+        }
+
+        /**
+         * @brief Compact the directories with DIR_COMPACT_FREES entries or more freed since they were last compacted.
+         *
+         * @param pred the directories that may be compacted now, e.g. not being read.
+         */
+        void compact_dirs(const std::function<bool(uint32_t)> &pred)
+        {
+            std::vector<uint32_t> dirs;
+            for (auto &&i : _dir_frees)
+            {
+                if (i.second >= DIR_COMPACT_FREES and pred(i.first))
+                    dirs.push_back(i.first);
+            }
+            for (auto &&i : dirs)
+                compact_dir(i);
+        }
+        /**
+         * @brief Get the inode object with its inode num.
+         * ! Caution: Not modify the inode bitmap
+         * @param inode_num
+         * @param inode
+         */
+        void get_inode(size_t inode_num, struct ext2_inode &inode)
+        {
+            auto *cached = _inodes.find(inode_num);
+            if (cached != nullptr)
+            {
+                inode = *cached;
+                return;
+            }
+            inode = read_inode(inode_num);
+            _inodes.insert(inode_num, inode, false);
+            evict_inodes();
+        }
+
+        /**
+         * @brief Get the inodes of many inode nums at once, e.g. of the entries of a directory. The ones not cached are read in
+         * inode num order, so each inode-table block is read once. They are not added to the inode cache, a large listing does not
+         * evict the inodes in use.
+         *
+         * @param nums
+         * @return std::vector<ext2_inode> in the order of nums.
+         */
+        std::vector<ext2_inode> get_inodes(const std::vector<uint32_t> &nums)
+        {
+            std::vector<ext2_inode> ret(nums.size());
+            std::vector<size_t> order(nums.size());
+            for (size_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            std::sort(order.begin(), order.end(), [&nums](size_t a, size_t b) { return nums[a] < nums[b]; });
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            uint32_t table_block = 0;
+            for (auto &&i : order)
+            {
+                auto *cached = _inodes.find(nums[i]);
+                if (cached != nullptr)
+                {
+                    ret[i] = *cached;
+                    continue;
+                }
+                auto loc = locate_inode(nums[i]);
+                if (loc.first != table_block)
+                {
+                    _disk.read_block(loc.first, mbuf.get());
+                    table_block = loc.first;
+                }
+                ret[i] = ((ext2_inode *)mbuf.get())[loc.second];
+            }
+            return ret;
+        }
+
+        /**
+         * @brief Read an inode from its inode-table block, bypassing the inode cache.
+         *
+         * @param inode_num
+         * @return ext2_inode
+         */
+        ext2_inode read_inode(size_t inode_num)
+        {
+            auto loc = locate_inode(inode_num);
+            _disk.read_block(loc.first, _buf);
+            auto *inode_table = (ext2_inode *)_buf;
+            return inode_table[loc.second];
+        }
+
+        /**
+         * @brief Free an entry of the inode.
+         *
+         * @param inode_num the directory inode.
+         * @param free_inode the inode to be freed.
+         * @param name the name of the entry, it locates the entry in an indexed directory.
+         */
+        void free_entry_to_inode(uint32_t inode_num, uint32_t free_inode, const std::string &name)
+        {
+            _dentries.insert(inode_num, name, DentryCache::negative);
+            _dir_version++;
+            _dir_frees[inode_num]++;
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            if (is_indexed_dir(inode))
+            {
+                std::vector<dx_frame> frames;
+                uint32_t hash, start;
+                auto leaf = dx_probe(inode_num, name, frames, hash);
+                do
+                {
+                    auto block = bmap(inode_num, leaf);
+                    _disk.read_block(block, _buf);
+                    if (entry_block(_buf).free(free_inode))
+                    {
+                        _disk.write_block(block, _buf);
+                        return;
+                    }
+                } while (dx_next(inode_num, frames, leaf, start) and (start & ~1u) == hash);
+                assert(0);
+            }
+            auto &&all_blocks = bmaps(inode_num, 0, get_block_count(inode_num));
+            for (size_t l = 0; l < all_blocks.size(); l++)
+            {
+                if (all_blocks[l] == EXT2M_I_BLOCK_SPARSE)
+                    continue;
+                _disk.read_block(all_blocks[l], _buf);
+                entry_block eb(_buf);
+                if (eb.free(free_inode))
+                {
+                    auto it = _dir_slots.find(inode_num);
+                    if (it != _dir_slots.end())
+                        it->second[l] = eb.largest_free();
+                    _disk.write_block(all_blocks[l], _buf);
+                    return;
+                }
+            }
+            assert(0);
+        }
+
+        /**
+         * @brief Get all blocks belongs to an inode.
+         *
+         * @param inode_num
+         * @param meta if not null, the indirect blocks are collected here.
+         * @return std::vector<uint32_t> blocks indexes.
+         */
+        std::vector<uint32_t> get_inode_all_blocks(size_t inode_num, std::vector<uint32_t> *meta = nullptr)
+        {
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            bool flag = true;
+            std::vector<uint32_t> indexs;
+            if (is_inline_inode(inode))
+                return indexs;
+            if (is_extent_inode(inode))
+            {
+                __ext_all_blocks__(ext_root(inode), indexs, meta);
+                return indexs;
+            }
+            for (int i = 0; i < EXT2_N_BLOCKS; i++)
+            {
+                auto n = inode.i_block[i];
+                if (i < EXT2_DIRECT_BLOCKS) // direct access block
+                {
+                    flag &= __get_inode_all_blocks__(n, 0, indexs, meta);
+                }
+                else if (i == EXT2_INDIRECT_BLOCK) // the first indirect block
+                {
+                    flag &= __get_inode_all_blocks__(n, 1, indexs, meta);
+                }
+                else if (i == EXT2_DOUBLY_INDIRECT_BLOCK) // the second indirect block
+                {
+                    flag &= __get_inode_all_blocks__(n, 2, indexs, meta);
+                }
+                else if (i == EXT2_TRIPLY_INDIRECT_BLOCK) // the third indirect block
+                {
+                    flag &= __get_inode_all_blocks__(n, 3, indexs, meta);
+                }
+                else
+                {
+                    assert(0);
+                }
+                if (not flag)
+                    break;
+            }
+            return indexs;
+        }
+
+        /**
+         * @brief Get the number of logical blocks one pointer at the level maps.
+         *
+         * @param level 0 for a data block, 1 for an indirect block ...
+         * @return uint64_t
+         */
+        static constexpr uint64_t blocks_per_level(int level)
+        {
+            return level == 0 ? 1 : (BLOCK_SIZE / sizeof(uint32_t)) * blocks_per_level(level - 1);
+        }
+
+        /**
+         * @brief Find the slot of i_block and the level under it that map a logical block.
+         *
+         * @param lblock
+         * @param[out] base the first logical block mapped by that slot
+         * @return std::pair<int, int> <slot in i_block, level>, slot is -1 if the block is beyond the triply indirect block.
+         */
+        static std::pair<int, int> locate_lblock(uint64_t lblock, uint64_t &base)
+        {
+            if (lblock < EXT2_DIRECT_BLOCKS)
+            {
+                base = lblock;
+                return {(int)lblock, 0};
+            }
+            base = EXT2_DIRECT_BLOCKS;
+            for (int level = 1; level <= 3; level++)
+            {
+                if (lblock < base + blocks_per_level(level))
+                    return {EXT2_DIRECT_BLOCKS + level - 1, level};
+                base += blocks_per_level(level);
+            }
+            return {-1, 0};
+        }
+
+        /**
+         * @brief Map the logical blocks [lo, hi) under one block of the tree. Recursively.
+         *
+         * @param _block_ind
+         * @param level
+         * @param base the first logical block mapped by _block_ind
+         * @param lo
+         * @param hi
+         * @param out
+         * @return true for continue, false for reach the end of the file.
+         */
+        bool __bmaps__(uint32_t _block_ind, int level, uint64_t base, uint64_t lo, uint64_t hi, std::vector<uint32_t> &out)
+        {
+            if (_block_ind == EXT2M_I_BLOCK_END)
+                return false;
+            if (level == 0)
+            {
+                out.push_back(_block_ind);
+                return true;
+            }
+            if (_block_ind == EXT2M_I_BLOCK_SPARSE) // the whole subtree is a hole
+            {
+                out.insert(out.end(), hi - lo, EXT2M_I_BLOCK_SPARSE);
+                return true;
+            }
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            _disk.read_block(_block_ind, mbuf.get());
+            auto *ptrs = (uint32_t *)mbuf.get();
+            auto per = blocks_per_level(level - 1);
+            auto first = (lo - base) / per;
+            auto last = (hi - 1 - base) / per;
+            for (auto k = first; k <= last; k++)
+            {
+                auto child = base + k * per;
+                if (not __bmaps__(ptrs[k], level - 1, child, std::max(lo, child), std::min(hi, child + per), out))
+                    return false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Count the data blocks under one block of the tree, blocks are added in order. Recursively.
+         *
+         * @param _block_ind
+         * @param level
+         * @return uint64_t
+         */
+        uint64_t __count_blocks__(uint32_t _block_ind, int level)
+        {
+            if (_block_ind == EXT2M_I_BLOCK_END)
+                return 0;
+            if (level == 0)
+                return 1;
+            if (_block_ind == EXT2M_I_BLOCK_SPARSE)
+                return blocks_per_level(level);
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            _disk.read_block(_block_ind, mbuf.get());
+            auto *ptrs = (uint32_t *)mbuf.get();
+            int k = BLOCK_SIZE / sizeof(uint32_t) - 1;
+            while (k >= 0 and ptrs[k] == EXT2M_I_BLOCK_END)
+                k--;
+            if (k < 0)
+                return 0;
+            return k * blocks_per_level(level - 1) + __count_blocks__(ptrs[k], level - 1);
+        }
+
+        /**
+         * @brief Map a range of logical blocks of an inode to disk blocks.
+         * Only the indirect blocks on the way are read, each one once.
+         *
+         * @param inode
+         * @param lblock first logical block
+         * @param count
+         * @return std::vector<uint32_t> disk blocks, EXT2M_I_BLOCK_SPARSE for a hole, shorter than count if the file has less blocks.
+         */
+        std::vector<uint32_t> bmaps(const ext2_inode &inode, uint64_t lblock, uint64_t count)
+        {
+            std::vector<uint32_t> out;
+            uint64_t hi = lblock + count;
+            if (is_inline_inode(inode))
+                return out;
+            if (is_extent_inode(inode))
+            {
+                __ext_bmaps__(ext_root(inode), lblock, hi, out);
+                return out;
+            }
+            while (lblock < hi)
+            {
+                uint64_t base;
+                auto loc = locate_lblock(lblock, base);
+                if (loc.first == -1)
+                    break;
+                uint64_t end = std::min(hi, base + blocks_per_level(loc.second));
+                if (not __bmaps__(inode.i_block[loc.first], loc.second, base, lblock, end, out))
+                    break;
+                lblock = end;
+            }
+            return out;
+        }
+
+        /**
+         * @brief Map a range of logical blocks of an inode with its cached extent map.
+         * The map is built by walking the whole block tree once, then kept up to date by add_block_to_inode.
+         *
+         * @param inode_num
+         * @param lblock
+         * @param count
+         * @return std::vector<uint32_t>
+         */
+        std::vector<uint32_t> bmaps(size_t inode_num, uint64_t lblock, uint64_t count)
+        {
+            return _extents.lookup(block_map(inode_num), lblock, count);
+        }
+
+        // the cached block map of an inode, built from its block pointers or extent tree if not cached
+        const ExtentCache::extent_map &block_map(size_t inode_num)
+        {
+            auto *map = _extents.find(inode_num);
+            if (map == nullptr)
+            {
+                ext2_inode inode;
+                get_inode(inode_num, inode);
+                map = &_extents.insert(inode_num, bmaps(inode, 0, get_block_count(inode)));
+            }
+            return *map;
+        }
+
+        /**
+         * @brief Map a logical block of an inode to its disk block, descending only the needed indirect levels.
+         *
+         * @param inode_num
+         * @param lblock
+         * @return uint32_t disk block, EXT2M_I_BLOCK_SPARSE for a hole, EXT2M_I_BLOCK_END if the file is shorter.
+         */
+        uint32_t bmap(size_t inode_num, uint64_t lblock)
+        {
+            uint32_t ret;
+            return _extents.lookup(block_map(inode_num), lblock, ret) ? ret : EXT2M_I_BLOCK_END;
+        }
+
+        /**
+         * @brief Get the number of blocks of an inode without walking all of them.
+         *
+         * @param inode_num
+         * @return uint64_t
+         */
+        uint64_t get_block_count(size_t inode_num)
+        {
+            auto *map = _extents.find(inode_num);
+            if (map != nullptr)
+                return map->blocks;
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            return get_block_count(inode);
+        }
+
+        uint64_t get_block_count(const ext2_inode &inode)
+        {
+            if (is_inline_inode(inode))
+                return 0;
+            if (is_extent_inode(inode))
+            {
+                ext2m_extent last;
+                return ext_last(inode, last) ? last.ee_block + last.ee_len : 0;
+            }
+            uint64_t base = EXT2_DIRECT_BLOCKS;
+            for (int level = 1; level <= 3; level++)
+                base += blocks_per_level(level);
+            for (int level = 3; level >= 1; level--)
+            {
+                base -= blocks_per_level(level);
+                auto n = inode.i_block[EXT2_DIRECT_BLOCKS + level - 1];
+                if (n != EXT2M_I_BLOCK_END)
+                    return base + __count_blocks__(n, level);
+            }
+            uint64_t cnt = 0;
+            while (cnt < EXT2_DIRECT_BLOCKS and inode.i_block[cnt] != EXT2M_I_BLOCK_END)
+                cnt++;
+            return cnt;
+        }
+
+        /*
+         * Extent mapped inodes : i_block holds the root of an extent tree, see ext2m_extent_header.
+         */
+
+        static constexpr uint16_t EXT_ROOT_MAX = (sizeof(ext2_inode::i_block) - sizeof(ext2m_extent_header)) / sizeof(ext2m_extent);
+        static constexpr uint16_t EXT_NODE_MAX = (BLOCK_SIZE - sizeof(ext2m_extent_header)) / sizeof(ext2m_extent);
+
+        static bool is_extent_inode(const ext2_inode &inode) { return inode.i_flags & EXT2M_EXTENTS_FL; }
+        static uint8_t *ext_root(ext2_inode &inode) { return (uint8_t *)&inode + offsetof(ext2_inode, i_block); }
+        static const uint8_t *ext_root(const ext2_inode &inode) { return (const uint8_t *)&inode + offsetof(ext2_inode, i_block); }
+        static ext2m_extent_header *ext_header(const uint8_t *node) { return (ext2m_extent_header *)node; }
+        static ext2m_extent *ext_extents(const uint8_t *node) { return (ext2m_extent *)(node + sizeof(ext2m_extent_header)); }
+        static ext2m_extent_idx *ext_indexes(const uint8_t *node) { return (ext2m_extent_idx *)(node + sizeof(ext2m_extent_header)); }
+
+        static void ext_init_node(uint8_t *node, uint16_t max, uint16_t depth)
+        {
+            auto *eh = ext_header(node);
+            eh->eh_magic = EXT2M_EXT_MAGIC;
+            eh->eh_entries = 0;
+            eh->eh_max = max;
+            eh->eh_depth = depth;
+            eh->eh_generation = 0;
+        }
+
+        /**
+         * @brief Make an inode extent mapped, with an empty tree.
+         *
+         * @param inode
+         */
+        static void ext_init_root(ext2_inode &inode)
+        {
+            memset(inode.i_block, 0, sizeof(inode.i_block));
+            ext_init_node(ext_root(inode), EXT_ROOT_MAX, 0);
+            inode.i_flags |= EXT2M_EXTENTS_FL;
+        }
+
+        /*
+         * Inline data : a file of up to INLINE_DATA_MAX bytes may keep its data in i_block, see EXT2M_INLINE_DATA_FL.
+         */
+
+        static constexpr size_t INLINE_DATA_MAX = sizeof(ext2_inode::i_block);
+
+        static bool is_inline_inode(const ext2_inode &inode) { return inode.i_flags & EXT2M_INLINE_DATA_FL; }
+        static uint8_t *inline_data(ext2_inode &inode) { return (uint8_t *)&inode + offsetof(ext2_inode, i_block); }
+
+        bool inline_data_enabled() const { return _superb.s_feature_incompat & EXT2M_FEATURE_INCOMPAT_INLINE_DATA; }
+
+        /**
+         * @brief Turn an inode without block into an inline data inode, its data is all zeros.
+         *
+         * @param inode
+         */
+        static void set_inline(ext2_inode &inode)
+        {
+            memset(inode.i_block, 0, sizeof(inode.i_block));
+            inode.i_flags &= ~EXT2M_EXTENTS_FL;
+            inode.i_flags |= EXT2M_INLINE_DATA_FL;
+        }
+
+        /**
+         * @brief Turn an inline data inode back into an inode without block, mapped as new inodes are. The caller keeps the data.
+         *
+         * @param inode
+         */
+        void clear_inline(ext2_inode &inode)
+        {
+            memset(inode.i_block, 0, sizeof(inode.i_block));
+            inode.i_flags &= ~EXT2M_INLINE_DATA_FL;
+            if (_superb.s_feature_incompat & EXT2M_FEATURE_INCOMPAT_EXTENTS)
+                ext_init_root(inode);
+        }
+
+        /*
+         * Unwritten blocks : fallocate maps blocks without zeroing them. An inode with EXT2M_UNWRITTEN_FL keeps in osd1 the written
+         * mark, the number of leading logical blocks holding real data. Its mapped blocks past the mark read as zeros, a write past
+         * the mark moves it forward.
+         */
+
+        static bool is_unwritten(const ext2_inode &inode, uint64_t lblock)
+        {
+            return (inode.i_flags & EXT2M_UNWRITTEN_FL) and lblock >= inode.osd1.linux1.l_i_reserved1;
+        }
+
+        /**
+         * @brief Get the written mark of an inode.
+         *
+         * @param inode
+         * @return uint64_t -1 if none of its blocks is unwritten.
+         */
+        static uint64_t written_mark(const ext2_inode &inode)
+        {
+            return (inode.i_flags & EXT2M_UNWRITTEN_FL) ? inode.osd1.linux1.l_i_reserved1 : (uint64_t)-1;
+        }
+
+        /**
+         * @brief Set the written mark of an inode, the flag is cleared once the mark covers all of its blocks.
+         *
+         * @param inode
+         * @param mark
+         * @param block_count
+         */
+        static void set_written_mark(ext2_inode &inode, uint64_t mark, uint64_t block_count)
+        {
+            if (mark >= block_count)
+            {
+                inode.i_flags &= ~EXT2M_UNWRITTEN_FL;
+                inode.osd1.linux1.l_i_reserved1 = 0;
+            }
+            else
+            {
+                inode.i_flags |= EXT2M_UNWRITTEN_FL;
+                inode.osd1.linux1.l_i_reserved1 = mark;
+            }
+        }
+
+        /**
+         * @brief Map the logical blocks [lo, hi) under a node of the extent tree, the gaps between extents are holes. Recursively.
+         *
+         * @param node
+         * @param lo
+         * @param hi
+         * @param out
+         * @return true for continue, false for reach the end of the file.
+         */
+        bool __ext_bmaps__(const uint8_t *node, uint64_t lo, uint64_t hi, std::vector<uint32_t> &out)
+        {
+            auto *eh = ext_header(node);
+            assert(eh->eh_magic == EXT2M_EXT_MAGIC);
+            if (eh->eh_depth == 0)
+            {
+                auto *ext = ext_extents(node);
+                for (int k = 0; k < eh->eh_entries and lo < hi; k++)
+                {
+                    uint64_t start = ext[k].ee_block, end = start + ext[k].ee_len;
+                    if (end <= lo)
+                        continue;
+                    if (start > lo)
+                    {
+                        auto gap = std::min(start, hi) - lo;
+                        out.insert(out.end(), gap, EXT2M_I_BLOCK_SPARSE);
+                        lo += gap;
+                    }
+                    for (; lo < std::min(hi, end); lo++)
+                        out.push_back(ext[k].ee_start_lo + (lo - start));
+                }
+                return lo == hi;
+            }
+            auto *idx = ext_indexes(node);
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            for (int k = 0; k < eh->eh_entries and lo < hi; k++)
+            {
+                bool last = k + 1 == eh->eh_entries;
+                uint64_t end = last ? hi : idx[k + 1].ei_block;
+                if (end <= lo)
+                    continue;
+                _disk.read_block(idx[k].ei_leaf_lo, mbuf.get());
+                auto child_hi = std::min(hi, end);
+                auto before = out.size();
+                if (not __ext_bmaps__(mbuf.get(), lo, child_hi, out))
+                {
+                    if (last)
+                        return false;
+                    // a hole up to the next subtree
+                    out.insert(out.end(), child_hi - lo - (out.size() - before), EXT2M_I_BLOCK_SPARSE);
+                }
+                lo = child_hi;
+            }
+            return lo == hi;
+        }
+
+        /**
+         * @brief Get the data blocks and the tree blocks under a node of the extent tree. Recursively.
+         *
+         * @param node
+         * @param arr
+         * @param meta if not null, the tree blocks are collected here.
+         */
+        void __ext_all_blocks__(const uint8_t *node, std::vector<uint32_t> &arr, std::vector<uint32_t> *meta)
+        {
+            auto *eh = ext_header(node);
+            assert(eh->eh_magic == EXT2M_EXT_MAGIC);
+            if (eh->eh_depth == 0)
+            {
+                auto *ext = ext_extents(node);
+                for (int k = 0; k < eh->eh_entries; k++)
+                    for (uint32_t j = 0; j < ext[k].ee_len; j++)
+                        arr.push_back(ext[k].ee_start_lo + j);
+                return;
+            }
+            auto *idx = ext_indexes(node);
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            for (int k = 0; k < eh->eh_entries; k++)
+            {
+                if (meta != nullptr)
+                    meta->push_back(idx[k].ei_leaf_lo);
+                _disk.read_block(idx[k].ei_leaf_lo, mbuf.get());
+                __ext_all_blocks__(mbuf.get(), arr, meta);
+            }
+        }
+
+        /**
+         * @brief Get the last extent of an extent mapped inode, walking down the rightmost path.
+         *
+         * @param inode
+         * @param[out] last
+         * @return false if the inode has no block.
+         */
+        bool ext_last(const ext2_inode &inode, ext2m_extent &last)
+        {
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            const uint8_t *node = ext_root(inode);
+            while (true)
+            {
+                auto *eh = ext_header(node);
+                assert(eh->eh_magic == EXT2M_EXT_MAGIC);
+                if (eh->eh_entries == 0)
+                    return false;
+                if (eh->eh_depth == 0)
+                {
+                    last = ext_extents(node)[eh->eh_entries - 1];
+                    return true;
+                }
+                _disk.read_block(ext_indexes(node)[eh->eh_entries - 1].ei_leaf_lo, mbuf.get());
+                node = mbuf.get();
+            }
+        }
+
+        /**
+         * @brief Move the full root of the extent tree down into a new block, the root becomes an index to it.
+         *
+         * @param inode_num
+         * @param inode
+         * @param alloc
+         * @param goal
+         */
+        void ext_grow(size_t inode_num, ext2_inode &inode, const std::function<uint32_t(uint32_t)> &alloc, uint32_t goal)
+        {
+            auto *root = ext_root(inode);
+            auto *eh = ext_header(root);
+            auto n = alloc(goal);
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            memset(mbuf.get(), 0, BLOCK_SIZE);
+            memcpy(mbuf.get(), root, sizeof(ext2m_extent_header) + eh->eh_entries * sizeof(ext2m_extent));
+            ext_header(mbuf.get())->eh_max = EXT_NODE_MAX;
+            _disk.write_block(n, mbuf.get());
+
+            // ee_block and ei_block are both the first field of an entry
+            auto first = ext_indexes(root)[0].ei_block;
+            eh->eh_depth++;
+            eh->eh_entries = 1;
+            auto *idx = ext_indexes(root);
+            idx[0].ei_block = first;
+            idx[0].ei_leaf_lo = n;
+            idx[0].ei_leaf_hi = 0;
+            idx[0].ei_unused = 0;
+            write_inode(inode_num, inode);
+        }
+
+        /**
+         * @brief Map len blocks from pblock at the logical block lblock, the end of an extent mapped file.
+         * The last extent is extended when the blocks follow it, otherwise a new extent is added to the rightmost leaf. When the leaf
+         * is full, a new leaf (and the index nodes above it) is added under the deepest node with room, and when all of them are
+         * full the tree grows by one level at the root.
+         *
+         * @param inode_num
+         * @param inode
+         * @param lblock
+         * @param pblock
+         * @param len
+         * @param alloc allocate a tree block near the goal.
+         */
+        void ext_append(size_t inode_num, ext2_inode &inode, uint64_t lblock, uint32_t pblock, uint32_t len, const std::function<uint32_t(uint32_t)> &alloc)
+        {
+            // the rightmost path, path[0] is the root in i_block
+            std::vector<uint8_t *> path{ext_root(inode)};
+            std::vector<std::unique_ptr<uint8_t[]>> bufs;
+            std::vector<uint32_t> path_blocks{0};
+            while (ext_header(path.back())->eh_depth > 0)
+            {
+                auto *eh = ext_header(path.back());
+                assert(eh->eh_magic == EXT2M_EXT_MAGIC and eh->eh_entries > 0);
+                auto n = ext_indexes(path.back())[eh->eh_entries - 1].ei_leaf_lo;
+                bufs.emplace_back(new uint8_t[BLOCK_SIZE]);
+                _disk.read_block(n, bufs.back().get());
+                path.push_back(bufs.back().get());
+                path_blocks.push_back(n);
+            }
+            auto write_node = [&](size_t level) {
+                if (level == 0)
+                    write_inode(inode_num, inode);
+                else
+                    _disk.write_block(path_blocks[level], path[level]);
+            };
+
+            auto *leaf = path.back();
+            auto *eh = ext_header(leaf);
+            auto *ext = ext_extents(leaf);
+            if (eh->eh_entries > 0)
+            {
+                auto &&last = ext[eh->eh_entries - 1];
+                if (last.ee_block + last.ee_len == lblock and last.ee_start_lo + last.ee_len == pblock and last.ee_len + len <= EXT2M_EXT_MAX_LEN)
+                {
+                    last.ee_len += len;
+                    write_node(path.size() - 1);
+                    return;
+                }
+            }
+            if (eh->eh_entries < eh->eh_max)
+            {
+                ext[eh->eh_entries++] = {(uint32_t)lblock, (uint16_t)len, 0, pblock};
+                write_node(path.size() - 1);
+                return;
+            }
+
+            // the deepest index node with room
+            ssize_t level = path.size() - 2;
+            while (level >= 0 and ext_header(path[level])->eh_entries == ext_header(path[level])->eh_max)
+                level--;
+            if (level < 0)
+            {
+                ext_grow(inode_num, inode, alloc, pblock + len);
+                return ext_append(inode_num, inode, lblock, pblock, len, alloc);
+            }
+
+            // a new chain down to a leaf holding the extent, built from the leaf up
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            uint32_t child = 0;
+            for (int depth = 0; depth < ext_header(path[level])->eh_depth; depth++)
+            {
+                auto n = alloc(pblock + len);
+                memset(mbuf.get(), 0, BLOCK_SIZE);
+                ext_init_node(mbuf.get(), EXT_NODE_MAX, depth);
+                ext_header(mbuf.get())->eh_entries = 1;
+                if (depth == 0)
+                    ext_extents(mbuf.get())[0] = {(uint32_t)lblock, (uint16_t)len, 0, pblock};
+                else
+                    ext_indexes(mbuf.get())[0] = {(uint32_t)lblock, child, 0, 0};
+                _disk.write_block(n, mbuf.get());
+                child = n;
+            }
+            auto *ih = ext_header(path[level]);
+            ext_indexes(path[level])[ih->eh_entries++] = {(uint32_t)lblock, child, 0, 0};
+            write_node(level);
+        }
+
+        /**
+         * @brief Map len blocks from pblock at the logical block lblock, inside a hole of an extent mapped file.
+         * The new extent is merged with its neighbours when they are contiguous with it, otherwise it is inserted in order into
+         * its leaf. A full node is split in two halves, the new half being added to the parent, up to the root which grows by one
+         * level when it is full.
+         *
+         * @param inode_num
+         * @param inode
+         * @param lblock
+         * @param pblock
+         * @param len
+         * @param alloc allocate a tree block near the goal.
+         */
+        void ext_insert(size_t inode_num, ext2_inode &inode, uint64_t lblock, uint32_t pblock, uint32_t len, const std::function<uint32_t(uint32_t)> &alloc)
+        {
+            // the path to the leaf covering lblock, path[0] is the root in i_block, pos[i] the entry taken in path[i]
+            std::vector<uint8_t *> path{ext_root(inode)};
+            std::vector<std::unique_ptr<uint8_t[]>> bufs;
+            std::vector<uint32_t> path_blocks{0};
+            std::vector<int> pos;
+            while (ext_header(path.back())->eh_depth > 0)
+            {
+                auto *eh = ext_header(path.back());
+                auto *idx = ext_indexes(path.back());
+                assert(eh->eh_magic == EXT2M_EXT_MAGIC and eh->eh_entries > 0);
+                int k = eh->eh_entries - 1;
+                while (k > 0 and idx[k].ei_block > lblock)
+                    k--;
+                pos.push_back(k);
+                bufs.emplace_back(new uint8_t[BLOCK_SIZE]);
+                _disk.read_block(idx[k].ei_leaf_lo, bufs.back().get());
+                path.push_back(bufs.back().get());
+                path_blocks.push_back(idx[k].ei_leaf_lo);
+            }
+            auto write_node = [&](size_t level) {
+                if (level == 0)
+                    write_inode(inode_num, inode);
+                else
+                    _disk.write_block(path_blocks[level], path[level]);
+            };
+
+            auto *leaf = path.back();
+            auto *eh = ext_header(leaf);
+            auto *ext = ext_extents(leaf);
+            int p = 0;
+            while (p < eh->eh_entries and ext[p].ee_block < lblock)
+                p++;
+            assert(p == eh->eh_entries or ext[p].ee_block >= lblock + len);
+            bool with_prev = p > 0 and ext[p - 1].ee_block + ext[p - 1].ee_len == lblock and
+                             ext[p - 1].ee_start_lo + ext[p - 1].ee_len == pblock and ext[p - 1].ee_len + len <= EXT2M_EXT_MAX_LEN;
+            bool with_next = p < eh->eh_entries and lblock + len == ext[p].ee_block and pblock + len == ext[p].ee_start_lo and
+                             ext[p].ee_len + len <= EXT2M_EXT_MAX_LEN;
+            if (with_prev)
+            {
+                ext[p - 1].ee_len += len;
+                if (with_next and ext[p - 1].ee_len + ext[p].ee_len <= EXT2M_EXT_MAX_LEN)
+                {
+                    ext[p - 1].ee_len += ext[p].ee_len;
+                    memmove(ext + p, ext + p + 1, (eh->eh_entries - p - 1) * sizeof(ext2m_extent));
+                    eh->eh_entries--;
+                }
+                write_node(path.size() - 1);
+                return;
+            }
+            if (with_next)
+            {
+                ext[p].ee_block = lblock;
+                ext[p].ee_start_lo = pblock;
+                ext[p].ee_len += len;
+                write_node(path.size() - 1);
+                return;
+            }
+
+            // insert the entry at position p of the node at level, splitting the full nodes on the way up
+            ext2m_extent e = {(uint32_t)lblock, (uint16_t)len, 0, pblock};
+            uint8_t entry[sizeof(ext2m_extent)];
+            memcpy(entry, &e, sizeof(entry));
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            for (size_t level = path.size() - 1;; level--)
+            {
+                auto *node = path[level];
+                auto *nh = ext_header(node);
+                auto *entries = node + sizeof(ext2m_extent_header);
+                if (nh->eh_entries < nh->eh_max)
+                {
+                    memmove(entries + (p + 1) * sizeof(entry), entries + p * sizeof(entry), (nh->eh_entries - p) * sizeof(entry));
+                    memcpy(entries + p * sizeof(entry), entry, sizeof(entry));
+                    nh->eh_entries++;
+                    write_node(level);
+                    return;
+                }
+                if (level == 0)
+                {
+                    // the root moves into a new block with room, the entry goes there
+                    ext_grow(inode_num, inode, alloc, pblock + len);
+                    auto n = ext_indexes(path[0])[0].ei_leaf_lo;
+                    _disk.read_block(n, mbuf.get());
+                    auto *child = mbuf.get() + sizeof(ext2m_extent_header);
+                    auto *ch = ext_header(mbuf.get());
+                    memmove(child + (p + 1) * sizeof(entry), child + p * sizeof(entry), (ch->eh_entries - p) * sizeof(entry));
+                    memcpy(child + p * sizeof(entry), entry, sizeof(entry));
+                    ch->eh_entries++;
+                    _disk.write_block(n, mbuf.get());
+                    return;
+                }
+                // split : the upper half moves to a new node right after this one
+                auto n = alloc(pblock + len);
+                int half = nh->eh_entries / 2;
+                memset(mbuf.get(), 0, BLOCK_SIZE);
+                ext_init_node(mbuf.get(), EXT_NODE_MAX, nh->eh_depth);
+                auto *sh = ext_header(mbuf.get());
+                auto *sibling = mbuf.get() + sizeof(ext2m_extent_header);
+                sh->eh_entries = nh->eh_entries - half;
+                memcpy(sibling, entries + half * sizeof(entry), sh->eh_entries * sizeof(entry));
+                nh->eh_entries = half;
+                if (p <= half)
+                {
+                    memmove(entries + (p + 1) * sizeof(entry), entries + p * sizeof(entry), (half - p) * sizeof(entry));
+                    memcpy(entries + p * sizeof(entry), entry, sizeof(entry));
+                    nh->eh_entries++;
+                }
+                else
+                {
+                    p -= half;
+                    memmove(sibling + (p + 1) * sizeof(entry), sibling + p * sizeof(entry), (sh->eh_entries - p) * sizeof(entry));
+                    memcpy(sibling + p * sizeof(entry), entry, sizeof(entry));
+                    sh->eh_entries++;
+                }
+                _disk.write_block(n, mbuf.get());
+                write_node(level);
+
+                // the index of the new node goes right after ours in the parent, ee_block and ei_block are the first field of an entry
+                ext2m_extent_idx idx = {*(uint32_t *)sibling, n, 0, 0};
+                memcpy(entry, &idx, sizeof(entry));
+                p = pos[level - 1] + 1;
+            }
+        }
+
+        /**
+         * @brief Add a block to an inode.
+         *
+         * @param inode_num
+         * @return uint32_t
+         */
+        uint32_t add_block_to_inode(size_t inode_num)
+        {
+            size_t group_index = inode_group(inode_num);
+
+            ext2_inode inode;
             get_inode(inode_num, inode);
 
+            assert(not is_inline_inode(inode));
+            bool is_dir = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+            auto alloc = [&](uint32_t goal) { return balloc_reserved(inode_num, group_index, goal, is_dir); };
+
+            // place the new block right after the file's last block
+            uint32_t goal = 0;
+
+            if (is_extent_inode(inode))
+            {
+                ext2m_extent last;
+                uint64_t lblock = 0;
+                if (ext_last(inode, last))
+                {
+                    lblock = last.ee_block + last.ee_len;
+                    goal = last.ee_start_lo + last.ee_len;
+                }
+                auto pos = alloc(goal);
+                ext_append(inode_num, inode, lblock, pos, 1, alloc);
+                _extents.append(inode_num, pos);
+                return pos;
+            }
+
             // direct access
             for (int i = 0; i < EXT2_DIRECT_BLOCKS; i++)
             {
                 auto nb = inode.i_block[i];
                 if (nb == EXT2M_I_BLOCK_END)
                 {
-                    auto pos = ballocs(group_index, 1).front();
+                    auto pos = alloc(goal);
                     inode.i_block[i] = pos;
                     write_inode(inode_num, inode);
+                    _extents.append(inode_num, pos);
                     return pos;
                 }
+                goal = nb + 1;
             }
 
-            // first indirect access
-            if (inode.i_block[EXT2_INDIRECT_BLOCK] == EXT2M_I_BLOCK_END)
+            static constexpr int levels[] = {EXT2_INDIRECT_BLOCK, EXT2_DOUBLY_INDIRECT_BLOCK, EXT2_TRIPLY_INDIRECT_BLOCK};
+            ssize_t ret = -1;
+            for (int level = 1; level <= 3 and ret == -1; level++)
             {
-                auto pos = ballocs(group_index, 1).front();
-                inode.i_block[EXT2_INDIRECT_BLOCK] = pos;
-                write_inode(inode_num, inode);
-
-                memset(_buf, 0, BLOCK_SIZE);
-                _disk.write_block(pos, _buf);
+                auto slot = levels[level - 1];
+                if (inode.i_block[slot] == EXT2M_I_BLOCK_END)
+                {
+                    auto pos = alloc(goal);
+                    inode.i_block[slot] = pos;
+                    write_inode(inode_num, inode);
+                    memset(_buf, 0, BLOCK_SIZE);
+                    _disk.write_block(pos, _buf);
+                    goal = pos + 1;
+                }
+                ret = __add_block_to_inode__(inode.i_block[slot], level, alloc, goal);
             }
-            ssize_t ret = __add_block_to_inode__(inode.i_block[EXT2_INDIRECT_BLOCK], 1, group_index);
             if (ret != -1)
-                return ret;
+                _extents.append(inode_num, ret);
+            return ret;
+        }
 
-            // second indirect access
-            if (inode.i_block[EXT2_DOUBLY_INDIRECT_BLOCK] == EXT2M_I_BLOCK_END)
+        /**
+         * @brief Count the indirect blocks to add to a file mapping have blocks, to map the logical blocks [lo, hi) with lo >= have.
+         * Only the indirect blocks starting at or after have and holding a block of the range are new, the others already exist or
+         * stay holes.
+         *
+         * @param have
+         * @param lo
+         * @param hi
+         * @return uint64_t
+         */
+        static uint64_t indirect_blocks_needed(uint64_t have, uint64_t lo, uint64_t hi)
+        {
+            uint64_t cnt = 0;
+            uint64_t base = EXT2_DIRECT_BLOCKS;
+            for (int level = 1; level <= 3; level++)
             {
-                auto pos = ballocs(group_index, 1).front();
-                inode.i_block[EXT2_DOUBLY_INDIRECT_BLOCK] = pos;
-                write_inode(inode_num, inode);
-                memset(_buf, 0, BLOCK_SIZE);
-                _disk.write_block(pos, _buf);
+                uint64_t end = base + blocks_per_level(level);
+                for (int k = 1; k <= level; k++)
+                {
+                    // nodes starting at base + j * per in [max(have, lo - per + 1), min(hi, end))
+                    auto per = blocks_per_level(k);
+                    uint64_t l = std::max({have, lo + 1 > per ? lo + 1 - per : 0, base}), h = std::min(hi, end);
+                    if (l < h)
+                        cnt += ceil(h - base, per) - ceil(l - base, per);
+                }
+                base = end;
+            }
+            return cnt;
+        }
+
+        /**
+         * @brief An upper bound of the blocks mapping count more data blocks in [lo, hi) takes, the indirect blocks or the extent tree
+         * nodes included. The indirect blocks are counted as if none existed, the extents as one per block.
+         *
+         * @param inode
+         * @param count
+         * @param lo
+         * @param hi
+         * @return uint64_t
+         */
+        static uint64_t blocks_to_map(const ext2_inode &inode, uint64_t count, uint64_t lo, uint64_t hi)
+        {
+            if (count == 0)
+                return 0;
+            if (is_extent_inode(inode))
+            {
+                // split nodes are half full, the leaves, their index nodes and a new path up to the root
+                auto leaves = ceil(count, EXT_NODE_MAX / 2);
+                return count + leaves + ceil(leaves, EXT_NODE_MAX / 2) + 4;
+            }
+            return count + indirect_blocks_needed(0, lo, hi);
+        }
+
+        /**
+         * @brief Map the logical blocks [lo, hi) under one block of the tree, taking the data blocks and the new indirect blocks
+         * from take() in order. The unmapped blocks in [hole_lo, hole_hi) become holes. Each indirect block is written once.
+         * Recursively.
+         *
+         * @param _block_ind
+         * @param level
+         * @param base the first logical block mapped by _block_ind
+         * @param hole_lo
+         * @param hole_hi
+         * @param lo
+         * @param hi
+         * @param fresh _block_ind was just taken and holds no pointer yet.
+         * @param take
+         * @param out the data blocks
+         */
+        void __add_blocks_to_inode__(uint32_t _block_ind, int level, uint64_t base, uint64_t hole_lo, uint64_t hole_hi, uint64_t lo,
+                                     uint64_t hi, bool fresh, const std::function<uint32_t()> &take, std::vector<uint32_t> &out)
+        {
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            if (fresh)
+                memset(mbuf.get(), 0, BLOCK_SIZE);
+            else
+                _disk.read_block(_block_ind, mbuf.get());
+            auto *ptrs = (uint32_t *)mbuf.get();
+            auto per = blocks_per_level(level - 1);
+            uint64_t from = std::max(std::min(hole_lo, lo), base), to = std::min(std::max(hole_hi, hi), base + blocks_per_level(level));
+            for (auto k = (from - base) / per; k <= (to - 1 - base) / per; k++)
+            {
+                auto child = base + k * per;
+                if (child + per <= lo or child >= hi)
+                {
+                    if (ptrs[k] == EXT2M_I_BLOCK_END)
+                        ptrs[k] = EXT2M_I_BLOCK_SPARSE;
+                    else if (level > 1 and ptrs[k] != EXT2M_I_BLOCK_SPARSE and child + per > hole_lo and child < hole_hi)
+                        // the node holding the old end of the file, only holes to add
+                        __add_blocks_to_inode__(ptrs[k], level - 1, child, hole_lo, hole_hi, child + per, child + per, false, take, out);
+                    continue;
+                }
+                if (level == 1)
+                {
+                    assert(ptrs[k] == EXT2M_I_BLOCK_END or ptrs[k] == EXT2M_I_BLOCK_SPARSE);
+                    ptrs[k] = take();
+                    out.push_back(ptrs[k]);
+                    continue;
+                }
+                // a hole subtree keeps the rest of its range as holes
+                bool was_hole = ptrs[k] == EXT2M_I_BLOCK_SPARSE;
+                bool new_child = was_hole or ptrs[k] == EXT2M_I_BLOCK_END;
+                if (new_child)
+                    ptrs[k] = take();
+                __add_blocks_to_inode__(ptrs[k], level - 1, child, was_hole ? child : hole_lo, was_hole ? child + per : hole_hi,
+                                        std::max(lo, child), std::min(hi, child + per), new_child, take, out);
+            }
+            _disk.write_block(_block_ind, mbuf.get());
+        }
+
+        /**
+         * @brief Map count new blocks at the logical block lblock of an inode in one pass, lblock defaults to the end of the file.
+         * The range must be beyond the end of the file or inside a hole. The blocks between the end of the file and lblock stay
+         * holes.
+         * When appending, the data blocks and the indirect blocks they need are taken from the inode's reservation window, then
+         * from one ballocs() request right after it, so the whole batch is laid out contiguously. The inode and each indirect
+         * block are read and written once.
+         *
+         * @param inode_num
+         * @param count
+         * @param lblock
+         * @return std::vector<uint32_t> the data blocks added, in logical order.
+         */
+        std::vector<uint32_t> add_blocks_to_inode(size_t inode_num, size_t count, uint64_t lblock = (uint64_t)-1)
+        {
+            std::vector<uint32_t> out;
+            if (count == 0)
+                return out;
+            size_t group_index = inode_group(inode_num);
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            assert(not is_inline_inode(inode));
+            bool is_dir = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+            uint64_t have = get_block_count(inode);
+            if (lblock == (uint64_t)-1)
+                lblock = have;
+            bool append = lblock >= have;
+            assert(append or lblock + count <= have);
+
+            // the block before lblock, the last block of the file when appending
+            uint32_t goal = 0;
+            if (lblock > 0 and lblock - 1 < have)
+            {
+                goal = bmaps(inode, lblock - 1, 1).at(0) + 1;
+                if (goal == EXT2M_I_BLOCK_SPARSE + 1)
+                    goal = 0;
             }
-            ret = __add_block_to_inode__(inode.i_block[EXT2_DOUBLY_INDIRECT_BLOCK], 2, group_index);
-            if (ret != -1)
-                return ret;
 
-            // third indirect access
-            if (inode.i_block[EXT2_TRIPLY_INDIRECT_BLOCK] == EXT2M_I_BLOCK_END)
+            // the pool : the reservation window first when appending, then one request for the rest
+            bool extents = is_extent_inode(inode);
+            size_t total = count + (extents or not append ? 0 : indirect_blocks_needed(have, lblock, lblock + count));
+            std::deque<uint32_t> pool;
+            auto it = _prealloc.find(inode_num);
+            if (append and it != _prealloc.end())
+            {
+                auto &&window = it->second;
+                while (not window.empty() and pool.size() < total)
+                {
+                    pool.push_back(window.front());
+                    window.pop_front();
+                }
+                if (window.empty())
+                    _prealloc.erase(it);
+                use_reserved(std::vector<uint32_t>(pool.begin(), pool.end()));
+            }
+            if (pool.size() < total)
             {
-                auto pos = ballocs(group_index, 1).front();
-                inode.i_block[EXT2_TRIPLY_INDIRECT_BLOCK] = pos;
+                auto &&more = ballocs(group_index, total - pool.size(), pool.empty() ? goal : pool.back() + 1);
+                pool.insert(pool.end(), more.begin(), more.end());
+            }
+            // filling a hole may need indirect blocks that are not counted, they come last
+            uint32_t last = goal;
+            auto take = [&]() {
+                if (pool.empty())
+                    pool.push_back(ballocs(group_index, 1, last).front());
+                last = pool.front() + 1;
+                pool.pop_front();
+                return last - 1;
+            };
+
+            if (extents)
+            {
+                auto alloc = [&](uint32_t goal) { return balloc_reserved(inode_num, group_index, goal, is_dir); };
+                while (out.size() < count)
+                    out.push_back(take());
+                // one extent per physical run
+                size_t k = 0;
+                while (k < out.size())
+                {
+                    uint32_t len = 1;
+                    while (k + len < out.size() and out[k + len] == out[k] + len and len < EXT2M_EXT_MAX_LEN)
+                        len++;
+                    if (append)
+                        ext_append(inode_num, inode, lblock + k, out[k], len, alloc);
+                    else
+                        ext_insert(inode_num, inode, lblock + k, out[k], len, alloc);
+                    k += len;
+                }
+            }
+            else
+            {
+                uint64_t lo = lblock, hi = lblock + count;
+                uint64_t hole_lo = append ? have : lo;
+                for (uint64_t l = std::min(hole_lo, lo); l < hi;)
+                {
+                    uint64_t base;
+                    auto loc = locate_lblock(l, base);
+                    assert(loc.first != -1);
+                    uint64_t end = base + blocks_per_level(loc.second);
+                    auto slot = loc.first;
+                    if (end <= lo)
+                    {
+                        if (inode.i_block[slot] == EXT2M_I_BLOCK_END)
+                            inode.i_block[slot] = EXT2M_I_BLOCK_SPARSE;
+                        else if (loc.second > 0 and inode.i_block[slot] != EXT2M_I_BLOCK_SPARSE)
+                            // the node holding the old end of the file, only holes to add
+                            __add_blocks_to_inode__(inode.i_block[slot], loc.second, base, hole_lo, lo, end, end, false, take, out);
+                    }
+                    else if (loc.second == 0)
+                    {
+                        inode.i_block[slot] = take();
+                        out.push_back(inode.i_block[slot]);
+                    }
+                    else
+                    {
+                        bool was_hole = inode.i_block[slot] == EXT2M_I_BLOCK_SPARSE;
+                        bool fresh = was_hole or inode.i_block[slot] == EXT2M_I_BLOCK_END;
+                        if (fresh)
+                            inode.i_block[slot] = take();
+                        __add_blocks_to_inode__(inode.i_block[slot], loc.second, base, was_hole ? base : hole_lo, was_hole ? end : lo,
+                                                std::max(lo, base), std::min(hi, end), fresh, take, out);
+                    }
+                    l = end;
+                }
                 write_inode(inode_num, inode);
-                memset(_buf, 0, BLOCK_SIZE);
-                _disk.write_block(pos, _buf);
             }
-            ret = __add_block_to_inode__(inode.i_block[EXT2_TRIPLY_INDIRECT_BLOCK], 3, group_index);
-            return ret;
+            assert(pool.empty());
+            if (append)
+            {
+                _extents.append_hole(inode_num, lblock - have);
+                for (auto &&n : out)
+                    _extents.append(inode_num, n);
+            }
+            else
+                _extents.erase(inode_num);
+            return out;
+        }
+
+        /**
+         * @brief Unmap the logical blocks from keep on under one block of the tree, base < keep < base + its span. The freed data
+         * and indirect blocks are collected. Recursively.
+         *
+         * @param _block_ind
+         * @param level
+         * @param base the first logical block mapped by _block_ind
+         * @param keep
+         * @param freed
+         */
+        void __truncate_blocks__(uint32_t _block_ind, int level, uint64_t base, uint64_t keep, std::vector<uint32_t> &freed)
+        {
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            _disk.read_block(_block_ind, mbuf.get());
+            auto *ptrs = (uint32_t *)mbuf.get();
+            auto per = blocks_per_level(level - 1);
+            auto partial = (keep - base) / per;
+            if ((keep - base) % per != 0 and level > 1 and ptrs[partial] != EXT2M_I_BLOCK_END and ptrs[partial] != EXT2M_I_BLOCK_SPARSE)
+                __truncate_blocks__(ptrs[partial], level - 1, base + partial * per, keep, freed);
+            for (auto k = ceil(keep - base, per); k < BLOCK_SIZE / sizeof(uint32_t); k++)
+            {
+                if (ptrs[k] == EXT2M_I_BLOCK_END)
+                    break;
+                __get_inode_all_blocks__(ptrs[k], level - 1, freed, &freed);
+                ptrs[k] = EXT2M_I_BLOCK_END;
+            }
+            _disk.write_block(_block_ind, mbuf.get());
+        }
+
+        /**
+         * @brief Unmap the logical blocks from keep on under a node of the extent tree, the node is changed in memory only. The freed
+         * data and tree blocks are collected. Recursively.
+         *
+         * @param node
+         * @param keep
+         * @param freed
+         */
+        void __ext_truncate__(uint8_t *node, uint64_t keep, std::vector<uint32_t> &freed)
+        {
+            auto *eh = ext_header(node);
+            assert(eh->eh_magic == EXT2M_EXT_MAGIC);
+            if (eh->eh_depth == 0)
+            {
+                auto *ext = ext_extents(node);
+                while (eh->eh_entries > 0)
+                {
+                    auto &&last = ext[eh->eh_entries - 1];
+                    uint64_t from = last.ee_block >= keep ? 0 : keep - last.ee_block;
+                    for (uint64_t j = from; j < last.ee_len; j++)
+                        freed.push_back(last.ee_start_lo + j);
+                    if (from > 0)
+                    {
+                        last.ee_len = std::min<uint64_t>(last.ee_len, from);
+                        break;
+                    }
+                    eh->eh_entries--;
+                }
+                return;
+            }
+            auto *idx = ext_indexes(node);
+            std::unique_ptr<uint8_t[]> mbuf(new uint8_t[BLOCK_SIZE]);
+            while (eh->eh_entries > 0)
+            {
+                auto &&last = idx[eh->eh_entries - 1];
+                _disk.read_block(last.ei_leaf_lo, mbuf.get());
+                if (last.ei_block >= keep)
+                    __ext_all_blocks__(mbuf.get(), freed, &freed);
+                else
+                {
+                    __ext_truncate__(mbuf.get(), keep, freed);
+                    if (ext_header(mbuf.get())->eh_entries > 0)
+                    {
+                        _disk.write_block(last.ei_leaf_lo, mbuf.get());
+                        break;
+                    }
+                }
+                freed.push_back(last.ei_leaf_lo);
+                eh->eh_entries--;
+            }
+        }
+
+        /**
+         * @brief Unmap the logical blocks of an inode from keep on, and free their data blocks and the indirect (or extent tree)
+         * blocks left empty, in one bitmap update per group.
+         *
+         * @param inode_num
+         * @param keep the number of logical blocks left
+         */
+        void truncate_blocks(size_t inode_num, uint64_t keep)
+        {
+            ext2_inode inode;
+            get_inode(inode_num, inode);
+            if (is_inline_inode(inode))
+                return;
+            discard_prealloc(inode_num);
+            _extents.erase(inode_num);
+            std::vector<uint32_t> freed;
+            if (is_extent_inode(inode))
+            {
+                auto *root = ext_root(inode);
+                __ext_truncate__(root, keep, freed);
+                if (ext_header(root)->eh_entries == 0)
+                    ext_init_node(root, EXT_ROOT_MAX, 0);
+            }
+            else
+            {
+                for (uint64_t i = keep; i < EXT2_DIRECT_BLOCKS; i++)
+                {
+                    if (inode.i_block[i] != EXT2M_I_BLOCK_END and inode.i_block[i] != EXT2M_I_BLOCK_SPARSE)
+                        freed.push_back(inode.i_block[i]);
+                    inode.i_block[i] = EXT2M_I_BLOCK_END;
+                }
+                uint64_t base = EXT2_DIRECT_BLOCKS;
+                for (int level = 1; level <= 3; level++)
+                {
+                    auto slot = EXT2_DIRECT_BLOCKS + level - 1;
+                    uint64_t end = base + blocks_per_level(level);
+                    auto n = inode.i_block[slot];
+                    if (base >= keep)
+                    {
+                        __get_inode_all_blocks__(n, level, freed, &freed);
+                        inode.i_block[slot] = EXT2M_I_BLOCK_END;
+                    }
+                    else if (keep < end and n != EXT2M_I_BLOCK_END and n != EXT2M_I_BLOCK_SPARSE)
+                        __truncate_blocks__(n, level, base, keep, freed);
+                    base = end;
+                }
+            }
+            if (keep <= written_mark(inode))
+                set_written_mark(inode, keep, keep);
+            write_inode(inode_num, inode);
+            bfrees(freed);
         }
     };
 
@@ -0,0 +1,225 @@
+#ifndef __EXTENTCACHE_H__
+#define __EXTENTCACHE_H__
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief In-memory logical to physical block maps of the recently used inodes.
+ * Each map is a sorted list of extents (logical start, physical start, length), so a file laid out contiguously costs a few
+ * entries whatever its size. Logical blocks between the extents are holes. The least recently used maps are dropped once the
+ * total number of extents exceeds the capacity.
+ */
+class ExtentCache
+{
+public:
+    struct extent
+    {
+        uint64_t lblock;
+        uint32_t pblock;
+        uint32_t len;
+    };
+
+    struct extent_map
+    {
+        std::vector<extent> extents;
+        uint64_t blocks = 0; // number of logical blocks mapped
+    };
+
+private:
+    const size_t _capacity; // max extents held over all inodes
+    size_t _size = 0;
+
+    std::list<uint32_t /*inode num*/> _lru_list; // Most Recently Used List , the back one is LRU.
+    struct item
+    {
+        extent_map map;
+        decltype(_lru_list.begin()) lru;
+    };
+    std::unordered_map<uint32_t, item> _maps;
+
+    void _shrink(uint32_t keep)
+    {
+        while (_size > _capacity and not _lru_list.empty() and _lru_list.back() != keep)
+            erase(_lru_list.back());
+    }
+
+    void _append(extent_map &map, uint32_t pblock)
+    {
+        auto &&ext = map.extents;
+        if (pblock != hole)
+        {
+            if (not ext.empty() and ext.back().lblock + ext.back().len == map.blocks and ext.back().pblock + ext.back().len == pblock)
+                ext.back().len++;
+            else
+            {
+                ext.push_back({map.blocks, pblock, 1});
+                _size++;
+            }
+        }
+        map.blocks++;
+    }
+
+public:
+    const uint32_t hole; // disk block reported for a hole
+
+    ExtentCache(size_t capacity, uint32_t hole) : _capacity(capacity), hole(hole) {}
+
+    /**
+     * @brief Get the map of an inode and mark it as recently used.
+     *
+     * @param inode_num
+     * @return extent_map* nullptr if not cached.
+     */
+    extent_map *find(uint32_t inode_num)
+    {
+        auto it = _maps.find(inode_num);
+        if (it == _maps.end())
+            return nullptr;
+        _lru_list.splice(_lru_list.begin(), _lru_list, it->second.lru);
+        return &it->second.map;
+    }
+
+    /**
+     * @brief Cache the map of an inode built from all of its disk blocks in logical order.
+     *
+     * @param inode_num
+     * @param blocks
+     * @return extent_map&
+     */
+    extent_map &insert(uint32_t inode_num, const std::vector<uint32_t> &blocks)
+    {
+        erase(inode_num);
+        _lru_list.push_front(inode_num);
+        auto &&it = _maps[inode_num];
+        it.lru = _lru_list.begin();
+        for (auto &&b : blocks)
+            _append(it.map, b);
+        _shrink(inode_num);
+        return it.map;
+    }
+
+    /**
+     * @brief Map the next logical block of a cached inode. Nothing is done if the inode is not cached.
+     *
+     * @param inode_num
+     * @param pblock the disk block, or hole
+     */
+    void append(uint32_t inode_num, uint32_t pblock)
+    {
+        auto it = _maps.find(inode_num);
+        if (it == _maps.end())
+            return;
+        _append(it->second.map, pblock);
+        _shrink(inode_num);
+    }
+
+    /**
+     * @brief Add count holes at the end of a cached inode.
+     *
+     * @param inode_num
+     * @param count
+     */
+    void append_hole(uint32_t inode_num, uint64_t count)
+    {
+        auto it = _maps.find(inode_num);
+        if (it != _maps.end())
+            it->second.map.blocks += count;
+    }
+
+    /**
+     * @brief Drop the map of an inode, e.g. when its blocks are freed.
+     *
+     * @param inode_num
+     */
+    void erase(uint32_t inode_num)
+    {
+        auto it = _maps.find(inode_num);
+        if (it == _maps.end())
+            return;
+        _size -= it->second.map.extents.size();
+        _lru_list.erase(it->second.lru);
+        _maps.erase(it);
+    }
+
+    void clear()
+    {
+        _maps.clear();
+        _lru_list.clear();
+        _size = 0;
+    }
+
+    /**
+     * @brief Map one logical block with a cached map, nothing is allocated.
+     *
+     * @param map
+     * @param lblock
+     * @param pblock set to the disk block, or hole
+     * @return false if the file has less blocks.
+     */
+    bool lookup(const extent_map &map, uint64_t lblock, uint32_t &pblock) const
+    {
+        if (lblock >= map.blocks)
+            return false;
+        // the last extent starting at or before lblock
+        auto it = std::upper_bound(map.extents.begin(), map.extents.end(), lblock,
+                                   [](uint64_t l, const extent &e) { return l < e.lblock; });
+        if (it != map.extents.begin() and lblock < (it - 1)->lblock + (it - 1)->len)
+            pblock = (it - 1)->pblock + (lblock - (it - 1)->lblock);
+        else
+            pblock = hole;
+        return true;
+    }
+
+    /**
+     * @brief Map the logical blocks [lblock, lblock + count) with a cached map.
+     *
+     * @param map
+     * @param lblock
+     * @param count
+     * @return std::vector<uint32_t> disk blocks or hole, shorter than count if the file has less blocks.
+     */
+    std::vector<uint32_t> lookup(const extent_map &map, uint64_t lblock, uint64_t count) const
+    {
+        std::vector<uint32_t> out;
+        if (lblock >= map.blocks)
+            return out;
+        count = std::min(count, map.blocks - lblock);
+        out.reserve(count);
+        // the last extent starting at or before lblock, or the first one if none
+        auto it = std::upper_bound(map.extents.begin(), map.extents.end(), lblock,
+                                   [](uint64_t l, const extent &e) { return l < e.lblock; });
+        if (it != map.extents.begin())
+            --it;
+        while (count > 0)
+        {
+            uint64_t n;
+            if (it == map.extents.end() or lblock < it->lblock)
+            {
+                // a hole up to the next extent
+                n = it == map.extents.end() ? count : std::min<uint64_t>(it->lblock - lblock, count);
+                out.insert(out.end(), n, hole);
+            }
+            else if (lblock >= it->lblock + it->len)
+            {
+                ++it;
+                continue;
+            }
+            else
+            {
+                auto skip = lblock - it->lblock;
+                n = std::min<uint64_t>(it->len - skip, count);
+                for (uint64_t k = 0; k < n; k++)
+                    out.push_back(it->pblock + skip + k);
+            }
+            lblock += n;
+            count -= n;
+        }
+        return out;
+    }
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef __FREESPACE_H__
+#define __FREESPACE_H__
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <tuple>
+
+/**
+ * @brief In-memory index of the free extents of a block group.
+ * Extents are kept both by start position, to merge neighbours on free, and by size, so a best-fit lookup is logarithmic
+ * instead of a linear walk over the bitmap.
+ */
+class FreeSpace
+{
+private:
+    std::map<uint32_t /*start*/, uint32_t /*length*/> _by_start;
+    std::set<std::pair<uint32_t /*length*/, uint32_t /*start*/>> _by_size;
+    uint32_t _total = 0;
+
+    void _add(uint32_t start, uint32_t len)
+    {
+        _by_start[start] = len;
+        _by_size.emplace(len, start);
+    }
+    void _erase(std::map<uint32_t, uint32_t>::iterator it)
+    {
+        _by_size.erase(std::make_pair(it->second, it->first));
+        _by_start.erase(it);
+    }
+
+public:
+    /**
+     * @brief Mark [start, start + len) free, merging it with the adjacent free extents.
+     *
+     * @param start
+     * @param len
+     */
+    void insert(uint32_t start, uint32_t len)
+    {
+        if (len == 0)
+            return;
+        _total += len;
+        auto next = _by_start.lower_bound(start);
+        assert(next == _by_start.end() or next->first >= start + len);
+        if (next != _by_start.end() and next->first == start + len)
+        {
+            len += next->second;
+            auto tmp = next++;
+            _erase(tmp);
+        }
+        if (next != _by_start.begin())
+        {
+            auto prev = std::prev(next);
+            assert(prev->first + prev->second <= start);
+            if (prev->first + prev->second == start)
+            {
+                start = prev->first;
+                len += prev->second;
+                _erase(prev);
+            }
+        }
+        _add(start, len);
+    }
+
+    /**
+     * @brief Mark [start, start + len) used. The range must be free.
+     *
+     * @param start
+     * @param len
+     */
+    void remove(uint32_t start, uint32_t len)
+    {
+        if (len == 0)
+            return;
+        auto it = _by_start.upper_bound(start);
+        assert(it != _by_start.begin());
+        --it;
+        uint32_t s = it->first, l = it->second;
+        assert(s <= start and start + len <= s + l);
+        _erase(it);
+        if (s < start)
+            _add(s, start - s);
+        if (start + len < s + l)
+            _add(start + len, s + l - start - len);
+        _total -= len;
+    }
+
+    /**
+     * @brief Get the length of the free run starting at pos.
+     *
+     * @param pos
+     * @return 0 if pos is used.
+     */
+    uint32_t run_at(uint32_t pos) const
+    {
+        auto it = _by_start.upper_bound(pos);
+        if (it == _by_start.begin())
+            return 0;
+        --it;
+        if (it->first + it->second <= pos)
+            return 0;
+        return it->first + it->second - pos;
+    }
+
+    /**
+     * @brief Find the smallest free extent holding at least count blocks, the one nearest to goal among equal sizes.
+     *
+     * @param count
+     * @param goal (uint32_t)-1 for no preference
+     * @return <start, length>, length is 0 if no extent is long enough.
+     */
+    std::pair<uint32_t, uint32_t> best_fit(uint32_t count, uint32_t goal = -1) const
+    {
+        auto it = _by_size.lower_bound(std::make_pair(count, 0u));
+        if (it == _by_size.end())
+            return {0, 0};
+        if (goal == (uint32_t)-1)
+            return {it->second, it->first};
+        auto len = it->first;
+        auto after = _by_size.lower_bound(std::make_pair(len, goal));
+        auto best = after;
+        if (after == _by_size.end() or after->first != len)
+            best = std::prev(after);
+        else if (after != it)
+        {
+            auto before = std::prev(after);
+            if (goal - before->second < after->second - goal)
+                best = before;
+        }
+        return {best->second, best->first};
+    }
+
+    /**
+     * @brief Get the largest free extent.
+     *
+     * @return <start, length>, length is 0 if nothing is free.
+     */
+    std::pair<uint32_t, uint32_t> largest() const
+    {
+        if (_by_size.empty())
+            return {0, 0};
+        auto it = _by_size.rbegin();
+        return {it->second, it->first};
+    }
+
+    uint32_t total() const
+    {
+        return _total;
+    }
+    bool empty() const
+    {
+        return _total == 0;
+    }
+    void clear()
+    {
+        _by_start.clear();
+        _by_size.clear();
+        _total = 0;
+    }
+};
+#endif
@@ -0,0 +1,180 @@
+#ifndef __INODECACHE_H__
+#define __INODECACHE_H__
+#include "ext2_spec.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Decoded inodes of the recently used files. A write only updates the cached inode and marks it dirty, the owner writes
+ * the dirty inodes back in batches. An inode whose timestamps only changed may be marked lazy instead, it is written back with
+ * the dirty ones only when asked to, or once it is old enough. Referenced inodes (e.g. open files) stay cached, the least
+ * recently used clean ones are dropped once the cache is full.
+ */
+class InodeCache
+{
+    const size_t _capacity;
+
+    std::list<uint32_t /*inode num*/> _lru_list; // Most Recently Used List , the back one is LRU.
+    struct item
+    {
+        ext2_inode inode;
+        bool dirty = false;
+        bool lazy = false;   // only the timestamps are stale on disk
+        uint32_t lazy_since; // when it became lazy
+        uint32_t refs = 0;
+        decltype(_lru_list.begin()) lru;
+    };
+    std::unordered_map<uint32_t, item> _items;
+    size_t _dirty = 0;
+
+public:
+    InodeCache(size_t capacity) : _capacity(capacity) {}
+
+    /**
+     * @brief Get a cached inode and mark it as recently used.
+     *
+     * @param inode_num
+     * @return ext2_inode* nullptr if not cached.
+     */
+    ext2_inode *find(uint32_t inode_num)
+    {
+        auto it = _items.find(inode_num);
+        if (it == _items.end())
+            return nullptr;
+        _lru_list.splice(_lru_list.begin(), _lru_list, it->second.lru);
+        return &it->second.inode;
+    }
+
+    /**
+     * @brief Cache an inode, or update the cached one.
+     *
+     * @param inode_num
+     * @param inode
+     * @param dirty true if the disk copy is now stale
+     */
+    void insert(uint32_t inode_num, const ext2_inode &inode, bool dirty)
+    {
+        auto it = _items.find(inode_num);
+        if (it == _items.end())
+        {
+            _lru_list.push_front(inode_num);
+            it = _items.emplace(inode_num, item()).first;
+            it->second.lru = _lru_list.begin();
+        }
+        else
+            _lru_list.splice(_lru_list.begin(), _lru_list, it->second.lru);
+        auto &&i = it->second;
+        i.inode = inode;
+        if (dirty and not i.dirty)
+        {
+            if (not i.lazy)
+                _dirty++;
+            i.dirty = true;
+            i.lazy = false;
+        }
+    }
+
+    /**
+     * @brief Update a cached inode whose timestamps only changed. A clean inode becomes lazy.
+     *
+     * @param inode_num
+     * @param inode
+     * @param now
+     */
+    void insert_lazy(uint32_t inode_num, const ext2_inode &inode, uint32_t now)
+    {
+        insert(inode_num, inode, false);
+        auto &&i = _items.at(inode_num);
+        if (not i.dirty and not i.lazy)
+        {
+            i.lazy = true;
+            i.lazy_since = now;
+            _dirty++;
+        }
+    }
+
+    /**
+     * @brief Take a reference on a cached inode, it is not dropped until put back.
+     *
+     * @param inode_num
+     */
+    void hold(uint32_t inode_num)
+    {
+        auto it = _items.find(inode_num);
+        assert(it != _items.end());
+        it->second.refs++;
+    }
+
+    void put(uint32_t inode_num)
+    {
+        auto it = _items.find(inode_num);
+        assert(it != _items.end() and it->second.refs > 0);
+        it->second.refs--;
+    }
+
+    /**
+     * @brief Get the dirty inodes in inode number order, so the inodes sharing an inode-table block are next to each other.
+     *
+     * @param lazy_before the lazy inodes that became lazy before it are included, 0 for none.
+     * @return std::vector<std::pair<uint32_t, const ext2_inode *>>
+     */
+    std::vector<std::pair<uint32_t, const ext2_inode *>> dirty(uint64_t lazy_before) const
+    {
+        std::vector<std::pair<uint32_t, const ext2_inode *>> ret;
+        ret.reserve(_dirty);
+        for (auto &&i : _items)
+            if (i.second.dirty or (i.second.lazy and i.second.lazy_since < lazy_before))
+                ret.emplace_back(i.first, &i.second.inode);
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+    /**
+     * @brief Mark an inode clean, once it is written back.
+     *
+     * @param inode_num
+     */
+    void clean(uint32_t inode_num)
+    {
+        auto &&i = _items.at(inode_num);
+        if (i.dirty or i.lazy)
+            _dirty--;
+        i.dirty = false;
+        i.lazy = false;
+    }
+
+    // the dirty and the lazy inodes
+    size_t dirty_count() const { return _dirty; }
+
+    bool full() const { return _items.size() > _capacity; }
+
+    /**
+     * @brief Drop the least recently used inodes that are clean (neither dirty nor lazy) and not referenced until the cache is not
+     * full.
+     */
+    void shrink()
+    {
+        for (auto it = _lru_list.end(); full() and it != _lru_list.begin();)
+        {
+            --it;
+            auto &&i = _items.at(*it);
+            if (i.dirty or i.lazy or i.refs > 0)
+                continue;
+            _items.erase(*it);
+            it = _lru_list.erase(it);
+        }
+    }
+
+    void clear()
+    {
+        _items.clear();
+        _lru_list.clear();
+        _dirty = 0;
+    }
+};
+
+#endif
@@ -13,18 +13,20 @@ int main(void)
     Cache cache(disk, 8 * BLOCK_SIZE);
     Ext2m::Ext2m ext2fs(cache);
     VFS vfs(ext2fs);
+    std::mutex mtx;
+    Shell sh(vfs, mtx);
 
-    cout << vfs.ls("/") << endl;
+    cout << sh.ls("/") << endl;
     vfs.mkdir("/home");
     vfs.mkdir("/home/delta");
-    cout << vfs.ls("/") << endl;
-    cout << vfs.ls("/home") << endl;
+    cout << sh.ls("/") << endl;
+    cout << sh.ls("/home") << endl;
 
     vfs.create("/home/delta/Readme.txt");
     int fd = vfs.open("/home/delta/Readme.txt", O_WRONLY);
     vfs.write(fd, "Hello World", 11);
     vfs.close(fd);
-    cout << vfs.ls("/home/delta") << endl;
+    cout << sh.ls("/home/delta") << endl;
 
     char buf[512];
     memset(buf, 0, sizeof(buf));
@@ -1,3 +1,6 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -8,7 +11,7 @@
 #include "user.hpp"
 #include "util.hpp"
 #include "vfs.hpp"
-#define helpMessage "Command:\npwd:                    Show working directory\ncd(chdir) [dirname]:    Switch current working directory\nls [dirname]:           Display the contents of the specified working directory\ncat(read) fileName:     Connect files and print to standard output devices\nmkdir dirName:          Create directory\nrm(remove) name...:     Delete a file or directory\ntouch(create) [name]:   Create a new file\nwrite message fileName: File write information\nrmdir dirName:          Delete empty directory\nmv source dest:         Rename or move a file or directory to another location\n"
+#define helpMessage "Command:\npwd:                    Show working directory\ncd(chdir) [dirname]:    Switch current working directory\nls [dirname]:           Display the contents of the specified working directory\ncat(read) fileName:     Connect files and print to standard output devices\nmkdir dirName:          Create directory\nrm(remove) name...:     Delete a file or directory\ntouch(create) [name]:   Create a new file\nwrite message fileName: File write information\ntruncate fileName size: Shrink or extend a file to the size\nfallocate fileName offset length: Reserve the blocks of a file range\nmkfiles dir prefix count: Create the files prefix0 ... prefix<count-1> in dir at once\nmkdirs dir prefix count: Create the directories prefix0 ... prefix<count-1> in dir at once\nrmdir dirName:          Delete empty directory\nmv source dest:         Rename or move a file or directory to another location\n"
 using namespace std;
 
 constexpr int COMMAND_LEN = 128;
@@ -23,6 +26,17 @@ void debug(const char* msg) {
     printf("[%s]: %s\n", output, msg);
 }
 
+// Parse a decimal operand sent by a client, false for a sign, any other character or a value out of range
+bool parse_number(const string& s, uint64_t& value) {
+    if (s.empty() or !isdigit((unsigned char)s[0])) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    value = strtoull(s.c_str(), &end, 10);
+    return errno == 0 and *end == '\0';
+}
+
 mutex mtx;
 VFS* _vfsp;
 
@@ -145,6 +159,45 @@ void handler(CTCPServer& server, ASocket::Socket socket) {
             }
             auto ret = sh.write(pos, content, offset);
             send_msg(ret);
+        } else if (com == "truncate") {
+            // Shrink or extend a file
+            if (comarr.size() < 3) {
+                send_msg("truncate: missing operand");
+                continue;
+            }
+            uint64_t size;
+            if (!parse_number(comarr[2], size)) {
+                send_msg("truncate: invalid number");
+                continue;
+            }
+            auto ret = sh.truncate(comarr[1], size);
+            send_msg(ret);
+        } else if (com == "fallocate") {
+            // Reserve space for a file range
+            if (comarr.size() < 4) {
+                send_msg("fallocate: missing operand");
+                continue;
+            }
+            uint64_t offset, len;
+            if (!parse_number(comarr[2], offset) or !parse_number(comarr[3], len)) {
+                send_msg("fallocate: invalid number");
+                continue;
+            }
+            auto ret = sh.fallocate(comarr[1], offset, len);
+            send_msg(ret);
+        } else if (com == "mkfiles" or com == "mkdirs") {
+            // Create many files or directories in one directory at once
+            if (comarr.size() < 4) {
+                send_msg(com + ": missing operand");
+                continue;
+            }
+            uint64_t count;
+            if (!parse_number(comarr[3], count)) {
+                send_msg(com + ": invalid number");
+                continue;
+            }
+            auto ret = sh.create_many(comarr[1], comarr[2], count, com == "mkdirs");
+            send_msg(ret);
         } else if (com == "rmdir") {
             // Command to delete an empty directory
             if (comarr.size() < 2) {
@@ -180,7 +233,8 @@ int main(int argc, char** argv) {
     Disk disk("disk.img");
     Cache cache(disk, 8 * BLOCK_SIZE);
     Ext2m::Ext2m ext2fs(cache);
-    VFS vfs(ext2fs);
+    // server [port] [mount options], e.g. server 60000 relatime,lazytime
+    VFS vfs(ext2fs, mount_options::parse(argc > 2 ? argv[2] : ""));
     _vfsp = &vfs;
 
     std::thread([&]() {
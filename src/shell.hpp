@@ -10,6 +10,7 @@ class Shell
     VFS &_vfs;
 
     std::string _pwd;
+    int _cwd; // a directory stream on _pwd, relative paths are resolved from it
 
     std::string to_abs(const std::string &dir)
     {
@@ -28,14 +29,51 @@ class Shell
         return _pwd + dir;
     }
 
+    /**
+     * @brief Drop the "." and ".." components of an absolute path, e.g. "/a/./b/../c" -> "/a/c/", as real_path() does but
+     * without looking the directories up.
+     *
+     * @param path
+     * @return std::string
+     */
+    static std::string normalize(const std::string &path)
+    {
+        std::vector<std::string> names;
+        path_iterator it(path.c_str());
+        const char *name;
+        size_t len;
+        while (it.next(name, len))
+        {
+            if (len == 1 and name[0] == '.')
+                continue;
+            if (len == 2 and name[0] == '.' and name[1] == '.')
+            {
+                if (not names.empty())
+                    names.pop_back();
+                continue;
+            }
+            names.emplace_back(name, len);
+        }
+        std::string ret("/");
+        for (auto &&i : names)
+        {
+            ret += i + "/";
+        }
+        return ret;
+    }
+
 public:
     Shell(VFS &vfs, std::mutex &mtx) : _vfs(vfs), _mtx(mtx)
     {
         _pwd = "/";
+        _mtx.lock();
+        _cwd = _vfs.opendir("/");
+        _mtx.unlock();
     }
     ~Shell()
     {
         _mtx.lock();
+        _vfs.closedir(_cwd);
         _vfs.sync();
         _mtx.unlock();
     }
@@ -45,42 +83,85 @@ public:
     }
     std::string cd(const std::string &dir)
     {
-        auto abs_dir = to_abs(dir);
         _mtx.lock();
-        auto ret = _vfs.exists(abs_dir.c_str());
-        _mtx.unlock();
-        if (ret == -1)
-        {
-            return "cd: " + dir + ": No such file or directory";
-        }
-        else if (ret == 0)
+        int dd = _vfs.opendirat(_cwd, dir.c_str());
+        if (dd == -1)
         {
+            struct stat st;
+            auto ret = _vfs.fstatat(_cwd, dir.c_str(), &st);
+            _mtx.unlock();
+            if (ret == -1)
+            {
+                return "cd: " + dir + ": No such file or directory";
+            }
             return "cd: " + dir + ": Not a directory";
         }
-        _mtx.lock();
-        _pwd = _vfs.real_path(abs_dir.c_str());
+        _vfs.closedir(_cwd);
+        _cwd = dd;
         _mtx.unlock();
+        _pwd = normalize(to_abs(dir));
         return "cd " + dir + ": OK";
     }
     std::string ls(const std::string &dir)
     {
         auto abs_dir = to_abs(dir);
+        std::vector<dirent_plus> entries;
         _mtx.lock();
-        auto ret = _vfs.ls(abs_dir.c_str());
-        _mtx.unlock();
-        if (ret.empty())
+        int dd = _vfs.opendirat(_cwd, dir.c_str());
+        if (dd == -1)
         {
+            _mtx.unlock();
             return "ls: " + dir + ": No such file or directory";
         }
+        // one batch, so each inode-table block is read once
+        _vfs.readdirplus(dd, entries, (size_t)-1);
+        _vfs.closedir(dd);
+        _mtx.unlock();
+
+        std::string ret;
+        char buf[1024];
+        ret.reserve(80 * (entries.size() + 3));
+        snprintf(buf, sizeof(buf), "%s:\n", abs_dir.c_str());
+        ret += buf;
+        snprintf(buf, sizeof(buf), "%-10s %-10s %20s %10s %15s\n", "ino", "type", "ctime", "size", "name");
+        ret += buf;
+        ret += "------------------------------------------------------------------------\n";
+
+        // the entries of a directory are often created within the same second
+        time_t last_ctime = -1;
+        char date[64] = {};
+        for (auto &&i : entries)
+        {
+            const char *type;
+            if ((i.st.st_mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+                type = "dir";
+            else if ((i.st.st_mode & EXT2_S_IFMT) == EXT2_S_IFREG)
+                type = "file";
+            else
+                type = "unknow";
+            if (i.st.st_ctime != last_ctime)
+            {
+                last_ctime = i.st.st_ctime;
+#if defined(_WIN32) || defined(WIN32)
+                struct tm t;
+                gmtime_s(&t, &last_ctime);
+                sprintf(date, "%d-%d-%d %d:%d:%d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour + 8, t.tm_min, t.tm_sec);
+#else
+                std::strftime(date, sizeof(date), "%F %T", localtime(&last_ctime));
+#endif
+            }
+            snprintf(buf, sizeof(buf), "%-10u %-10s %20s %10lld %15s\n", (unsigned)i.st.st_ino, type, date, (long long)i.st.st_size,
+                     i.name.c_str());
+            ret += buf;
+        }
         return ret;
     }
     std::string cat(const std::string &file_path)
     {
-        auto abs_file = to_abs(file_path);
         char buf[2048];
         memset(buf, 0, sizeof(buf));
         _mtx.lock();
-        int fd = _vfs.open(abs_file.c_str(), O_RDONLY);
+        int fd = _vfs.openat(_cwd, file_path.c_str(), O_RDONLY);
         if (fd == -1)
         {
             _mtx.unlock();
@@ -94,23 +175,22 @@ public:
 
     std::string touch(const std::string &file_path)
     {
-        auto abs_file = to_abs(file_path);
         _mtx.lock();
-        int ret = _vfs.create(abs_file.c_str());
-        if (ret == -1)
+        int fd = _vfs.openat(_cwd, file_path.c_str(), O_WRONLY | O_CREAT | O_EXCL);
+        if (fd == -1)
         {
             _mtx.unlock();
             return "touch: " + file_path + ": File exists or Path is not valid";
         }
+        _vfs.close(fd);
         _mtx.unlock();
         return "touch: " + file_path + ": OK";
     }
 
     std::string write(const std::string &file_path, const std::string &content, size_t offset)
     {
-        auto abs_file = to_abs(file_path);
         _mtx.lock();
-        int fd = _vfs.open(abs_file.c_str(), O_WRONLY);
+        int fd = _vfs.openat(_cwd, file_path.c_str(), O_WRONLY);
         if (fd == -1)
         {
             _mtx.unlock();
@@ -123,11 +203,41 @@ public:
         return "write: " + file_path + ": OK";
     }
 
+    std::string truncate(const std::string &file_path, size_t size)
+    {
+        _mtx.lock();
+        int ret = _vfs.truncateat(_cwd, file_path.c_str(), size);
+        _mtx.unlock();
+        if (ret == -1)
+        {
+            return "truncate: " + file_path + ": No such file or directory";
+        }
+        return "truncate: " + file_path + ": OK";
+    }
+
+    std::string fallocate(const std::string &file_path, size_t offset, size_t len)
+    {
+        _mtx.lock();
+        int fd = _vfs.openat(_cwd, file_path.c_str(), O_WRONLY);
+        if (fd == -1)
+        {
+            _mtx.unlock();
+            return "fallocate: " + file_path + ": No such file or directory";
+        }
+        int ret = _vfs.fallocate(fd, offset, len);
+        _vfs.close(fd);
+        _mtx.unlock();
+        if (ret == -1)
+        {
+            return "fallocate: " + file_path + ": Invalid range";
+        }
+        return "fallocate: " + file_path + ": OK";
+    }
+
     std::string unlink(const std::string &file_path)
     {
-        auto abs_file = to_abs(file_path);
         _mtx.lock();
-        int ret = _vfs.unlink(abs_file.c_str());
+        int ret = _vfs.unlinkat(_cwd, file_path.c_str(), 0);
         _mtx.unlock();
         if (ret == -1)
         {
@@ -138,9 +248,8 @@ public:
 
     std::string mkdir(const std::string &dir_path)
     {
-        auto abs_dir = to_abs(dir_path);
         _mtx.lock();
-        int ret = _vfs.mkdir(abs_dir.c_str());
+        int ret = _vfs.mkdirat(_cwd, dir_path.c_str());
         _mtx.unlock();
         if (ret == -1)
         {
@@ -149,11 +258,43 @@ public:
         return "mkdir: " + dir_path + ": OK";
     }
 
+    /**
+     * @brief Create the files (or directories) prefix0 ... prefix<count - 1> in a directory in one go, see VFS::create_many().
+     *
+     * @param dir_path
+     * @param prefix
+     * @param count
+     * @param is_dir
+     * @return std::string
+     */
+    std::string create_many(const std::string &dir_path, const std::string &prefix, size_t count, bool is_dir)
+    {
+        std::string cmd = is_dir ? "mkdirs" : "mkfiles";
+        // the count comes from the client, check it before building the names
+        if (count == 0 or count > CREATE_MANY_MAX)
+        {
+            return cmd + ": " + std::to_string(count) + ": Count must be 1 to " + std::to_string(CREATE_MANY_MAX);
+        }
+        std::vector<std::string> names;
+        names.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            names.push_back(prefix + std::to_string(i));
+        }
+        _mtx.lock();
+        int ret = _vfs.create_manyat(_cwd, dir_path.c_str(), names, is_dir);
+        _mtx.unlock();
+        if (ret == -1)
+        {
+            return cmd + ": " + dir_path + ": Path is not valid or a name exists";
+        }
+        return cmd + ": " + dir_path + ": " + std::to_string(count) + " created";
+    }
+
     std::string rmdir(const std::string &dir_path)
     {
-        auto abs_dir = to_abs(dir_path);
         _mtx.lock();
-        int ret = _vfs.rmdir(abs_dir.c_str());
+        int ret = _vfs.unlinkat(_cwd, dir_path.c_str(), AT_REMOVEDIR);
         _mtx.unlock();
         if (ret == -1)
         {
@@ -164,12 +305,8 @@ public:
 
     std::string mv(const std::string &src, const std::string &dst)
     {
-        auto abs_src = to_abs(src);
-        auto abs_dst = to_abs(dst);
-        std::cout << abs_src << std::endl;
-        std::cout << abs_dst << std::endl;
         _mtx.lock();
-        int ret = _vfs.mv(abs_src.c_str(), abs_dst.c_str());
+        int ret = _vfs.renameat(_cwd, src.c_str(), _cwd, dst.c_str());
         _mtx.unlock();
         if (ret == -1)
         {
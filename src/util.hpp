@@ -7,14 +7,43 @@
 std::vector<std::string> split(const char *str, const char *delim)
 {
     std::vector<std::string> ret;
-    char *tmp = strdup(str);
-    char *p = strtok(tmp, delim);
-    while (p)
+    for (str += strspn(str, delim); *str != '\0'; str += strspn(str, delim))
     {
-        ret.push_back(p);
-        p = strtok(NULL, delim);
+        auto len = strcspn(str, delim);
+        ret.emplace_back(str, len);
+        str += len;
     }
-    free(tmp);
     return ret;
 }
-#endif
\ No newline at end of file
+
+/**
+ * @brief The components of a path, e.g. "a" and "b" of "/a//b/", as views over the path itself. Nothing is copied or allocated.
+ */
+class path_iterator
+{
+    const char *_p;
+
+public:
+    path_iterator(const char *path) : _p(path) {}
+
+    /**
+     * @brief Get the next component.
+     *
+     * @param name set to its first char, it is not null terminated.
+     * @param len set to its length.
+     * @return false if no component is left.
+     */
+    bool next(const char *&name, size_t &len)
+    {
+        while (*_p == '/')
+            _p++;
+        if (*_p == '\0')
+            return false;
+        name = _p;
+        while (*_p != '\0' and *_p != '/')
+            _p++;
+        len = _p - name;
+        return true;
+    }
+};
+#endif
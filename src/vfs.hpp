@@ -7,86 +7,224 @@
 #include <iostream>
 #include <fcntl.h>
 #include <ctime>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+/**
+ * @brief Mount options of the timestamp updates.
+ */
+struct mount_options
+{
+    enum
+    {
+        STRICTATIME, // atime is updated on every access
+        RELATIME,    // atime is updated only if older than mtime, ctime or a day
+        NOATIME,     // atime is never updated
+    } atime = STRICTATIME;
+    // an inode whose timestamps only changed is written back lazily, see Ext2m::write_inode_times()
+    bool lazytime = false;
+    // index the directories of an image formatted without DIR_INDEX, the feature stays on afterwards
+    bool dir_index = false;
+
+    /**
+     * @brief Parse comma separated options, e.g. "noatime,lazytime". Unknown options are ignored.
+     *
+     * @param opts
+     * @return mount_options
+     */
+    static mount_options parse(const std::string &opts)
+    {
+        mount_options ret;
+        for (auto &&o : split(opts.c_str(), ","))
+        {
+            if (o == "strictatime")
+                ret.atime = STRICTATIME;
+            else if (o == "relatime")
+                ret.atime = RELATIME;
+            else if (o == "noatime")
+                ret.atime = NOATIME;
+            else if (o == "lazytime")
+                ret.lazytime = true;
+            else if (o == "nolazytime")
+                ret.lazytime = false;
+            else if (o == "dir_index")
+                ret.dir_index = true;
+        }
+        return ret;
+    }
+};
+
+// a directory entry with the attributes of its inode, see VFS::readdirplus()
+struct dirent_plus
+{
+    std::string name;
+    uint8_t file_type;
+    struct stat st;
+};
 
 class VFS
 {
     std::string _cwd;
     uint8_t _buf[BLOCK_SIZE];
     Ext2m::Ext2m &_ext2;
+    const mount_options _options;
     bool _find_dir_from_inode_new_create_flag;
 
-    ssize_t find_dir_from_inode(uint32_t inode_idx, const std::string &name, bool creat = false)
+    /**
+     * @brief Update the access time of an inode as the mount options say.
+     *
+     * @param inode
+     * @return true if it changed.
+     */
+    bool touch_atime(ext2_inode &inode)
     {
-        _find_dir_from_inode_new_create_flag = false;
-        auto entrys = _ext2.get_inode_all_entry(inode_idx);
-        for (auto &&j : entrys)
+        uint32_t now = time(NULL);
+        switch (_options.atime)
         {
-            if (j.name == name)
-            {
-                return j.inode;
-            }
+        case mount_options::NOATIME:
+            return false;
+        case mount_options::RELATIME:
+            if (inode.i_atime > inode.i_mtime and inode.i_atime > inode.i_ctime and now - inode.i_atime < 24 * 60 * 60)
+                return false;
+            break;
+        default:
+            break;
         }
-        if (not creat)
+        if (inode.i_atime == now)
+            return false;
+        inode.i_atime = now;
+        return true;
+    }
+
+    /**
+     * @brief Write an inode back, lazily if only its timestamps differ from before and the lazytime option is set.
+     *
+     * @param inode_idx
+     * @param inode
+     * @param before the inode as read
+     */
+    void write_inode(uint32_t inode_idx, const ext2_inode &inode, const ext2_inode &before)
+    {
+        ext2_inode times = before;
+        times.i_atime = inode.i_atime;
+        times.i_mtime = inode.i_mtime;
+        times.i_ctime = inode.i_ctime;
+        if (_options.lazytime and memcmp(&times, &inode, sizeof(ext2_inode)) == 0)
+            _ext2.write_inode_times(inode_idx, inode);
+        else
+            _ext2.write_inode(inode_idx, inode);
+    }
+
+    ssize_t find_dir_from_inode(uint32_t inode_idx, const char *name, size_t len, bool creat = false)
+    {
+        _find_dir_from_inode_new_create_flag = false;
+        auto idx = _ext2.find_entry(inode_idx, name, len);
+        if (idx != -1 or not creat or len > EXT2_NAME_LEN)
+            return idx;
+        ext2_inode parent;
+        _ext2.get_inode(inode_idx, parent);
+        if (not check_dir(parent.i_mode))
             return -1;
 
-        auto newid = _ext2.ialloc();
+        auto newid = _ext2.ialloc(inode_idx, true);
         if (newid == 0)
             return -1;
-        size_t group = newid / _ext2.inodes_per_group;
         ext2_inode inode;
         // TODO: UID, GID, mode
         _ext2.init_inode(inode, EXT2_S_IFDIR | 0755, 0, 0);
-        inode.i_block[0] = _ext2.ballocs(group, 1).front();
         _ext2.write_inode(newid, inode);
+        auto block = _ext2.add_block_to_inode(newid);
 
         memset(_buf, 0, BLOCK_SIZE);
         _ext2.init_entry_block(_buf, newid, inode_idx);
-        _ext2._disk.write_block(inode.i_block[0], _buf);
+        _ext2._disk.write_block(block, _buf);
 
         Ext2m::entry e;
         e.file_type = EXT2_FT_DIR;
         e.inode = newid;
-        e.name = name;
+        e.name.assign(name, len);
         _ext2.add_entry_to_inode(inode_idx, e);
         _find_dir_from_inode_new_create_flag = true;
         return newid;
     }
 
-    int mkdir_from_root(const char *absolute_path)
+    /**
+     * @brief Walk a path down to the directory holding its last component. The components are looked up as views over the path,
+     * nothing is allocated once the names are in the dentry cache.
+     *
+     * @param dir the directory a relative path starts from, an absolute one starts from the root.
+     * @param path
+     * @param parent set to that directory, the start one if the path has no component (e.g. "/" or "").
+     * @param name set to the last component, it is not null terminated, nullptr if the path has no component.
+     * @param len set to its length.
+     * @return int -1 if a directory on the way does not exist or is not a directory.
+     */
+    int walk_parent(uint32_t dir, const char *path, uint32_t &parent, const char *&name, size_t &len)
     {
-        assert(absolute_path[0] == '/');
-        auto &&paths = split(absolute_path, "/");
-        uint32_t inode_idx = ROOT_INODE;
-        for (auto &&i : paths)
+        path_iterator it(path);
+        parent = path[0] == '/' ? ROOT_INODE : dir;
+        name = nullptr;
+        len = 0;
+        const char *next;
+        size_t next_len;
+        while (it.next(next, next_len))
         {
-            auto idx = find_dir_from_inode(inode_idx, i, true);
-            if (idx == -1 or _find_dir_from_inode_new_create_flag == false)
-                return -1;
-            inode_idx = idx;
+            if (name != nullptr)
+            {
+                auto idx = _ext2.find_entry(parent, name, len);
+                if (idx == -1)
+                    return -1;
+                parent = idx;
+            }
+            name = next;
+            len = next_len;
         }
-        return 0;
+        // the directories on the way are checked by find_entry(), the last one is checked here
+        ext2_inode inode;
+        _ext2.get_inode(parent, inode);
+        return check_dir(inode.i_mode) ? 0 : -1;
     }
 
-    int create_file_from_root(const char *absolute_path)
+    /**
+     * @brief Get the inode of a path, see walk_parent().
+     *
+     * @param dir
+     * @param path
+     * @return ssize_t -1 if it does not exist.
+     */
+    ssize_t lookup(uint32_t dir, const char *path)
     {
-        assert(absolute_path[0] == '/');
-        auto &&paths = split(absolute_path, "/");
-        auto file_name = paths.back();
-        paths.pop_back();
-        if (file_name.size() > EXT2_NAME_LEN)
+        uint32_t parent;
+        const char *name;
+        size_t len;
+        if (walk_parent(dir, path, parent, name, len) == -1)
             return -1;
-        uint32_t inode_idx = ROOT_INODE;
-        for (auto &&i : paths)
-        {
-            auto idx = find_dir_from_inode(inode_idx, i);
-            if (idx == -1)
-                return -1;
-            inode_idx = idx;
-        }
-        auto idx = find_dir_from_inode(inode_idx, file_name);
-        if (idx != -1)
+        return name == nullptr ? parent : _ext2.find_entry(parent, name, len);
+    }
+
+    int mkdir_at(uint32_t dir, const char *path)
+    {
+        uint32_t parent;
+        const char *name;
+        size_t len;
+        // as with mkdir(2) the parents must exist, only the last component is created
+        if (walk_parent(dir, path, parent, name, len) == -1 or name == nullptr)
+            return -1;
+        return find_dir_from_inode(parent, name, len, true) != -1 and _find_dir_from_inode_new_create_flag ? 0 : -1;
+    }
+
+    int create_file_at(uint32_t dir, const char *path)
+    {
+        uint32_t inode_idx;
+        const char *file_name;
+        size_t len;
+        if (walk_parent(dir, path, inode_idx, file_name, len) == -1 or file_name == nullptr or len > EXT2_NAME_LEN)
             return -1;
-        auto nid = _ext2.ialloc();
+        if (_ext2.find_entry(inode_idx, file_name, len) != -1)
+            return -1;
+        auto nid = _ext2.ialloc(inode_idx);
         if (nid == 0)
             return -1;
         ext2_inode inode;
@@ -95,26 +233,76 @@ class VFS
         Ext2m::entry e;
         e.file_type = EXT2_FT_REG_FILE;
         e.inode = nid;
-        e.name = file_name;
+        e.name.assign(file_name, len);
         _ext2.add_entry_to_inode(inode_idx, e);
 
         return 0;
     }
 
-    int stat_from_root(const char *absolute_path, struct stat *buf)
+    int create_many_at(uint32_t dir, const char *path, const std::vector<std::string> &names, bool is_dir)
     {
-        assert(absolute_path[0] == '/');
-        auto &&paths = split(absolute_path, "/");
-        uint32_t inode_idx = ROOT_INODE;
-        for (auto &&i : paths)
+        auto parent = lookup(dir, path);
+        if (parent == -1 or names.empty() or names.size() > CREATE_MANY_MAX)
+            return -1;
+        ext2_inode inode;
+        _ext2.get_inode(parent, inode);
+        if (not check_dir(inode.i_mode))
+            return -1;
+        std::unordered_set<std::string> batch;
+        for (auto &&i : names)
         {
-            auto idx = find_dir_from_inode(inode_idx, i);
-            if (idx == -1)
+            if (i.empty() or i.size() > EXT2_NAME_LEN or i.find('/') != std::string::npos or i == "." or i == "..")
                 return -1;
-            inode_idx = idx;
+            if (not batch.insert(i).second)
+                return -1;
+        }
+        // none of them may exist, a linear directory is read once for all of them
+        if (Ext2m::Ext2m::is_indexed_dir(inode))
+        {
+            for (auto &&i : names)
+            {
+                if (_ext2.find_entry(parent, i) != -1)
+                    return -1;
+            }
         }
+        else
+        {
+            Ext2m::Ext2m::dir_iterator it(_ext2, parent);
+            Ext2m::dirent_view e;
+            while (it.next(e))
+            {
+                if (batch.count(e.str()) != 0)
+                    return -1;
+            }
+        }
+
+        auto &&nums = _ext2.create_inodes(parent, names.size(), is_dir ? EXT2_S_IFDIR | 0755 : EXT2_S_IFREG | 0644);
+        if (nums.empty())
+            return -1;
+        std::vector<Ext2m::entry> ents(names.size());
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            ents[i].file_type = is_dir ? EXT2_FT_DIR : EXT2_FT_REG_FILE;
+            ents[i].inode = nums[i];
+            ents[i].name = names[i];
+        }
+        _ext2.add_entries_to_inode(parent, ents);
+        return 0;
+    }
+
+    int stat_at(uint32_t dir, const char *path, struct stat *buf)
+    {
+        auto inode_idx = lookup(dir, path);
+        if (inode_idx == -1)
+            return -1;
         ext2_inode inode;
         _ext2.get_inode(inode_idx, inode);
+        fill_stat(inode_idx, inode, buf);
+        return 0;
+    }
+
+    void fill_stat(uint32_t inode_idx, const ext2_inode &inode, struct stat *buf)
+    {
         buf->st_ino = inode_idx;
         buf->st_mode = inode.i_mode;
         buf->st_size = inode.i_size;
@@ -124,125 +312,264 @@ class VFS
         buf->st_atime = inode.i_atime;
         buf->st_mtime = inode.i_mtime;
         buf->st_ctime = inode.i_ctime;
-        return 0;
     }
 
-    std::string ls_from_root(const char *absolute_path)
+    int rmdir_at(uint32_t dir, const char *path)
     {
-        std::cout << absolute_path << std::endl;
-        assert(absolute_path[0] == '/');
-        auto &&paths = split(absolute_path, "/");
-        uint32_t inode_idx = ROOT_INODE;
-        for (auto &&i : paths)
+        uint32_t father_inode;
+        const char *name;
+        size_t len;
+        if (walk_parent(dir, path, father_inode, name, len) == -1 or name == nullptr)
+            return -1;
+        if ((len == 1 and name[0] == '.') or (len == 2 and name[0] == '.' and name[1] == '.'))
+            return -1;
+        auto inode_idx = _ext2.find_entry(father_inode, name, len);
+        if (inode_idx == -1 or inode_idx == ROOT_INODE or is_opendir(inode_idx))
+            return -1;
+        ext2_inode inode;
+        _ext2.get_inode(inode_idx, inode);
+        if (not check_dir(inode.i_mode))
+            return -1;
+        bool delable = true;
         {
-            auto idx = find_dir_from_inode(inode_idx, i);
-            if (idx == -1)
-                return "";
-            inode_idx = idx;
+            // stops at the first entry other than "." and ".."
+            Ext2m::Ext2m::dir_iterator it(_ext2, inode_idx);
+            Ext2m::dirent_view i;
+            while (it.next(i))
+            {
+                if (i.is("."))
+                {
+                    assert(i.inode == inode_idx);
+                }
+                else if (not i.is(".."))
+                {
+                    delable = false;
+                    break;
+                }
+            }
         }
-        auto entrys = _ext2.get_inode_all_entry(inode_idx);
+        if (!delable)
+            return -1;
+        _ext2.free_entry_to_inode(father_inode, inode_idx, std::string(name, len));
+        _ext2.ifree(inode_idx);
+        return 0;
+    }
 
-        std::string ret;
-        char buf[1024];
-        memset(buf, 0, 1024);
+    int unlink_at(uint32_t dir, const char *path)
+    {
+        uint32_t father_idx;
+        const char *name;
+        size_t len;
+        if (walk_parent(dir, path, father_idx, name, len) == -1 or name == nullptr)
+            return -1;
+        auto inode_idx = _ext2.find_entry(father_idx, name, len);
+        if (inode_idx == -1)
+            return -1;
+        // TODO :should check link_count == 1
+        ext2_inode inode;
+        _ext2.get_inode(inode_idx, inode);
+        if (not check_regular_file(inode.i_mode))
+            return -1;
 
-        sprintf(buf, "%s:\n", absolute_path);
-        ret += buf;
+        _ext2.free_entry_to_inode(father_idx, inode_idx, std::string(name, len));
+        drop_delayed(inode_idx);
+        _ext2.ifree(inode_idx);
+        return 0;
+    }
 
-        sprintf(buf, "%-10s %-10s %20s %10s %15s\n", "ino", "type", "ctime", "size", "name");
-        ret += buf;
-        sprintf(buf, "------------------------------------------------------------------------\n");
-        ret += buf;
+    // data of file blocks not allocated yet (delayed allocation) : inode -> logical block -> block content
+    std::unordered_map<uint32_t, std::map<uint32_t, std::unique_ptr<uint8_t[]>>> _delayed;
+    size_t _delayed_blocks = 0;
 
-        for (auto &&i : entrys)
+    /**
+     * @brief Allocate the delayed blocks of an inode, one contiguous batch per run of consecutive blocks, and write their data out.
+     * The blocks between the runs are left as holes.
+     *
+     * @param inode_idx
+     */
+    void writeback(uint32_t inode_idx)
+    {
+        auto it = _delayed.find(inode_idx);
+        if (it == _delayed.end())
+            return;
+        auto &&pages = it->second;
+        auto page = pages.begin();
+        while (page != pages.end())
         {
-            ext2_inode inode;
-            _ext2.get_inode(i.inode, inode);
-            std::string type;
-            if (check_dir(inode.i_mode))
-                type = "dir";
-            else if (check_regular_file(inode.i_mode))
-                type = "file";
-            else
-                type = "unknow";
-            char output[64] = {};
-            auto t = time_t(inode.i_ctime);
-#if defined(_WIN32) || defined(WIN32)
-            struct tm date;
-            gmtime_s(&date, &t);
-            sprintf(output, "%d-%d-%d %d:%d:%d", date.tm_year + 1900, date.tm_mon + 1, date.tm_mday, date.tm_hour + 8, date.tm_min, date.tm_sec);
-#else
-            std::strftime(output, sizeof(output), "%F %T", localtime(&t));
-#endif
-            sprintf(buf, "%-10d %-10s %20s %10d %15s\n", i.inode, type.c_str(), output, inode.i_size, i.name.c_str());
-            ret += buf;
+            // a run filling a hole stops at the end of the file, the rest is appended
+            uint64_t have = _ext2.get_block_count(inode_idx);
+            uint64_t max = page->first < have ? have - page->first : (uint64_t)-1;
+            uint32_t n = 1;
+            for (auto next = std::next(page); next != pages.end() and next->first == page->first + n and n < max; ++next)
+                n++;
+            auto &&blocks = _ext2.add_blocks_to_inode(inode_idx, n, page->first);
+            for (auto &&b : blocks)
+            {
+                _ext2._disk.write_block(b, page->second.get());
+                ++page;
+            }
         }
-        return ret;
+        if (not is_open(inode_idx))
+            _ext2.discard_prealloc(inode_idx);
+        _delayed_blocks -= pages.size();
+        _delayed.erase(it);
     }
 
-    int rmdir_from_root(const char *absolute_path)
+    /**
+     * @brief Get the delayed data of a logical block of an inode.
+     *
+     * @param inode_idx
+     * @param lblock
+     * @return uint8_t* nullptr if the block has none.
+     */
+    uint8_t *delayed_page(uint32_t inode_idx, uint32_t lblock)
     {
-        assert(absolute_path[0] == '/');
-        auto &&paths = split(absolute_path, "/");
-        uint32_t inode_idx = ROOT_INODE;
-        for (auto &&i : paths)
-        {
-            auto idx = find_dir_from_inode(inode_idx, i);
-            if (idx == -1)
-                return -1;
-            inode_idx = idx;
-        }
-        if (inode_idx == ROOT_INODE)
-            return -1;
-        auto &&entrys = _ext2.get_inode_all_entry(inode_idx);
-        bool delable = true;
-        uint32_t father_inode = 0;
-        for (auto &&i : entrys)
+        auto it = _delayed.find(inode_idx);
+        if (it == _delayed.end())
+            return nullptr;
+        auto page = it->second.find(lblock);
+        return page == it->second.end() ? nullptr : page->second.get();
+    }
+
+    /**
+     * @brief Find the first offset at or after offset in data (or in a hole) of a file. The end of the file counts as a hole.
+     *
+     * @param inode_idx
+     * @param inode
+     * @param offset less than the file size
+     * @param data
+     * @return off_t -1 if there is no data after offset.
+     */
+    off_t seek_data_or_hole(uint32_t inode_idx, ext2_inode &inode, off_t offset, bool data)
+    {
+        if (_ext2.is_inline_inode(inode))
+            return data ? offset : inode.i_size;
+        // a chunk of the block map at a time
+        constexpr uint32_t CHUNK = BLOCK_SIZE;
+        uint64_t last = Ext2m::ceil(inode.i_size, BLOCK_SIZE);
+        for (uint64_t first = offset / BLOCK_SIZE; first < last; first += CHUNK)
         {
-            if (i.name == ".")
+            auto &&blocks = _ext2.bmaps(inode_idx, first, std::min<uint64_t>(CHUNK, last - first));
+            for (uint64_t i = first; i < std::min<uint64_t>(first + CHUNK, last); i++)
             {
-                assert(i.inode == inode_idx);
+                bool has_data = (i - first < blocks.size() and blocks[i - first] != EXT2M_I_BLOCK_SPARSE) or
+                                delayed_page(inode_idx, i) != nullptr;
+                if (has_data == data)
+                    return std::max<off_t>(offset, i * BLOCK_SIZE);
             }
-            else if (i.name == "..")
+        }
+        return data ? -1 : inode.i_size;
+    }
+
+    /**
+     * @brief Move the data of an inline file to a delayed page of its first block, allocated at writeback. The inode is left
+     * without block, the caller writes it.
+     *
+     * @param inode_idx
+     * @param inode
+     */
+    void uninline(uint32_t inode_idx, ext2_inode &inode)
+    {
+        auto &&page = _delayed[inode_idx][0];
+        page.reset(new uint8_t[BLOCK_SIZE]);
+        memset(page.get(), 0, BLOCK_SIZE);
+        memcpy(page.get(), _ext2.inline_data(inode), Ext2m::Ext2m::INLINE_DATA_MAX);
+        _delayed_blocks++;
+        _ext2.clear_inline(inode);
+    }
+
+    /**
+     * @brief Set the size of a file. The blocks past the new end are freed in one pass and the rest of the last block is zeroed,
+     * a grown file ends with a hole.
+     *
+     * @param inode_idx
+     * @param length
+     */
+    void truncate_inode(uint32_t inode_idx, uint64_t length)
+    {
+        assert(length <= UINT32_MAX);
+        ext2_inode inode;
+        _ext2.get_inode(inode_idx, inode);
+        if (_ext2.is_inline_inode(inode))
+        {
+            if (length <= Ext2m::Ext2m::INLINE_DATA_MAX)
+                memset(_ext2.inline_data(inode) + length, 0, Ext2m::Ext2m::INLINE_DATA_MAX - length);
+            else
+                uninline(inode_idx, inode);
+        }
+        else if (length < inode.i_size)
+        {
+            uint64_t keep = Ext2m::ceil(length, BLOCK_SIZE);
+            auto it = _delayed.find(inode_idx);
+            if (it != _delayed.end())
             {
-                father_inode = i.inode;
+                auto &&pages = it->second;
+                auto from = pages.lower_bound(keep);
+                _delayed_blocks -= std::distance(from, pages.end());
+                pages.erase(from, pages.end());
+                if (pages.empty())
+                    _delayed.erase(it);
             }
-            else
+            _ext2.truncate_blocks(inode_idx, keep);
+            _ext2.get_inode(inode_idx, inode);
+
+            // the rest of the last block reads as zeros if the file grows again
+            size_t in_block = length % BLOCK_SIZE;
+            if (in_block != 0)
             {
-                delable = false;
-                break;
+                auto lblock = length / BLOCK_SIZE;
+                auto *page = delayed_page(inode_idx, lblock);
+                if (page != nullptr)
+                    memset(page + in_block, 0, BLOCK_SIZE - in_block);
+                else
+                {
+                    auto block = _ext2.bmap(inode_idx, lblock);
+                    if (block != EXT2M_I_BLOCK_END and block != EXT2M_I_BLOCK_SPARSE)
+                    {
+                        _ext2._disk.read_block(block, _buf);
+                        memset(_buf + in_block, 0, BLOCK_SIZE - in_block);
+                        _ext2._disk.write_block(block, _buf);
+                    }
+                }
             }
         }
-        if (!delable)
-            return -1;
-        _ext2.free_entry_to_inode(father_inode, inode_idx);
-        _ext2.ifree(inode_idx);
-        return 0;
+        inode.i_size = length;
+        inode.i_mtime = time(NULL);
+        inode.i_ctime = inode.i_mtime;
+        _ext2.write_inode(inode_idx, inode);
     }
 
-    int unlink_from_root(const char *absolute_path)
+    /**
+     * @brief Write zeros over disk blocks, holes are skipped.
+     *
+     * @param blocks
+     */
+    void zero_blocks(const std::vector<uint32_t> &blocks)
     {
-        assert(absolute_path[0] == '/');
-        auto &&paths = split(absolute_path, "/");
-        uint32_t father_idx = 0;
-        uint32_t inode_idx = ROOT_INODE;
-        for (auto &&i : paths)
-        {
-            auto idx = find_dir_from_inode(inode_idx, i);
-            if (idx == -1)
-                return -1;
-            father_idx = inode_idx;
-            inode_idx = idx;
-        }
-        // TODO :should check link_count == 1
-        ext2_inode inode;
-        _ext2.get_inode(inode_idx, inode);
-        if (not check_regular_file(inode.i_mode))
-            return -1;
+        memset(_buf, 0, BLOCK_SIZE);
+        for (auto &&b : blocks)
+            if (b != EXT2M_I_BLOCK_SPARSE)
+                _ext2._disk.write_block(b, _buf);
+    }
 
-        _ext2.free_entry_to_inode(father_idx, inode_idx);
-        _ext2.ifree(inode_idx);
-        return 0;
+    void writeback_all()
+    {
+        while (not _delayed.empty())
+            writeback(_delayed.begin()->first);
+    }
+
+    /**
+     * @brief Drop the delayed data of a file being deleted, it never reaches the allocator.
+     *
+     * @param inode_idx
+     */
+    void drop_delayed(uint32_t inode_idx)
+    {
+        auto it = _delayed.find(inode_idx);
+        if (it == _delayed.end())
+            return;
+        _delayed_blocks -= it->second.size();
+        _delayed.erase(it);
     }
 
     struct file_description
@@ -253,6 +580,24 @@ class VFS
     };
     std::vector<file_description> _files;
 
+    // open directory streams, see opendir()
+    std::vector<std::unique_ptr<Ext2m::Ext2m::dir_iterator>> _dirs;
+
+    bool check_dd(int dd)
+    {
+        return dd >= 0 and dd < (int)_dirs.size() and _dirs[dd] != nullptr;
+    }
+
+    bool is_opendir(uint32_t inode_idx)
+    {
+        for (auto &&i : _dirs)
+        {
+            if (i != nullptr and i->inode_num() == inode_idx)
+                return true;
+        }
+        return false;
+    }
+
     int get_avaiable_fd()
     {
         size_t i = 3;
@@ -272,6 +617,16 @@ class VFS
         return _files[fd].inode_idx != 0;
     }
 
+    bool is_open(uint32_t inode_idx)
+    {
+        for (auto &&i : _files)
+        {
+            if (i.inode_idx == inode_idx)
+                return true;
+        }
+        return false;
+    }
+
     bool check_writeable(int flag)
     {
         if ((flag & O_ACCMODE) == O_RDONLY)
@@ -310,21 +665,14 @@ class VFS
         return true;
     }
 
-    int open_file_from_root(const char *absolute_path, int flag)
+    int open_file_at(uint32_t dir, const char *path, int flag)
     {
         // flag : O_RDONLY, O_WRONLY, O_RDWR
         // check if flag contains O_CREAT
 
-        assert(absolute_path[0] == '/');
-        auto &&paths = split(absolute_path, "/");
-        uint32_t inode_idx = ROOT_INODE;
-        for (auto &&i : paths)
-        {
-            auto idx = find_dir_from_inode(inode_idx, i);
-            if (idx == -1)
-                return -1;
-            inode_idx = idx;
-        }
+        auto inode_idx = lookup(dir, path);
+        if (inode_idx == -1)
+            return -1;
         file_description _fdd;
         _fdd.flag = flag;
         _fdd.inode_idx = inode_idx;
@@ -335,51 +683,34 @@ class VFS
         _fdd.offset = 0;
         auto fd = get_avaiable_fd();
         _files[fd] = _fdd;
+        // the inode of an open file stays in memory
+        _ext2.iget(inode_idx);
         return fd;
     }
 
-    int mv_from_root(const char *old_path, const char *new_path)
+    int mv_at(uint32_t old_dir, const char *old_path, uint32_t new_dir, const char *new_path)
     {
-        auto &&paths = split(old_path, "/");
-        uint32_t father_idx = 0;
-        uint32_t inode_idx = ROOT_INODE;
-        for (auto &&i : paths)
-        {
-            auto idx = find_dir_from_inode(inode_idx, i);
-            if (idx == -1)
-                return -1;
-            father_idx = inode_idx;
-            inode_idx = idx;
-        }
-
-        auto &&npath = split(new_path, "/");
-        if (npath.empty())
+        uint32_t father_idx;
+        const char *name;
+        size_t len;
+        if (walk_parent(old_dir, old_path, father_idx, name, len) == -1 or name == nullptr)
+            return -1;
+        auto inode_idx = _ext2.find_entry(father_idx, name, len);
+        if (inode_idx == -1)
             return -1;
-        auto rname = npath.back();
-        npath.pop_back();
-
-        auto all_entrys = _ext2.get_inode_all_entry(father_idx);
-        for (auto &&i : all_entrys)
-        {
-            if (i.name == rname)
-            {
-                return -1;
-            }
-        }
 
-        uint32_t target_inode_idx = ROOT_INODE;
-        for (auto &&i : npath)
-        {
-            auto idx = find_dir_from_inode(target_inode_idx, i);
-            if (idx == -1)
-                return -1;
-            target_inode_idx = idx;
-        }
+        uint32_t target_inode_idx;
+        const char *rname;
+        size_t rlen;
+        if (walk_parent(new_dir, new_path, target_inode_idx, rname, rlen) == -1 or rname == nullptr or rlen > EXT2_NAME_LEN)
+            return -1;
+        if (_ext2.find_entry(target_inode_idx, rname, rlen) != -1)
+            return -1;
 
         ext2_inode inode;
         _ext2.get_inode(inode_idx, inode);
 
-        _ext2.free_entry_to_inode(father_idx, inode_idx);
+        _ext2.free_entry_to_inode(father_idx, inode_idx, std::string(name, len));
 
         Ext2m::entry e;
         if (check_regular_file(inode.i_mode))
@@ -389,44 +720,79 @@ class VFS
         else
             assert(0);
         e.inode = inode_idx;
-        e.name = rname;
+        e.name.assign(rname, rlen);
 
         _ext2.add_entry_to_inode(target_inode_idx, e);
         return 0;
     }
 
-    std::string to_absolute_path(const char *_path)
+    /**
+     * @brief Get the directory a handle refers to.
+     *
+     * @param dd a directory stream, or AT_FDCWD for the root.
+     * @return uint32_t 0 if dd is not open.
+     */
+    uint32_t dir_of(int dd)
     {
-        return _path;
+        if (dd == AT_FDCWD)
+            return ROOT_INODE;
+        return check_dd(dd) ? _dirs[dd]->inode_num() : 0;
     }
 
 public:
-    VFS(Ext2m::Ext2m &ext2) : _ext2(ext2)
+    VFS(Ext2m::Ext2m &ext2, const mount_options &options = mount_options()) : _ext2(ext2), _options(options)
     {
         // 0,1,2 for stdin,stdout,stderr
         _files.resize(3);
+        if (_options.dir_index)
+            _ext2.enable_dir_index();
     }
     ~VFS()
     {
-        _ext2.sync();
+        sync();
     }
 
     int open(const char *path, int flags)
     {
-        auto str = to_absolute_path(path);
-        if ((flags & ~O_ACCMODE) == O_CREAT)
+        return openat(AT_FDCWD, path, flags);
+    }
+
+    /**
+     * @brief Open a file relative to a directory handle, so the directories above it are not looked up again. The *at() calls
+     * below all take such a handle, it is ignored if the path is absolute.
+     *
+     * @param dd a directory stream from opendir() or opendirat(), AT_FDCWD for the root.
+     * @param path
+     * @param flags O_CREAT with O_EXCL fails if the file exists.
+     * @return int the fd, -1 on failure.
+     */
+    int openat(int dd, const char *path, int flags)
+    {
+        auto dir = dir_of(dd);
+        if (dir == 0)
+            return -1;
+        if (flags & O_CREAT)
         {
-            create(path);
+            if (create_file_at(dir, path) == -1 and (flags & O_EXCL))
+                return -1;
         }
-        return open_file_from_root(str.c_str(), flags);
+        auto fd = open_file_at(dir, path, flags);
+        if (fd != -1 and (flags & O_TRUNC) and check_writeable(flags))
+            truncate_inode(_files[fd].inode_idx, 0);
+        return fd;
     }
     int close(int fd)
     {
         if (!check_fd(fd))
             return -1;
+        auto inode_idx = _files[fd].inode_idx;
         _files[fd].inode_idx = 0;
         _files[fd].flag = 0;
         _files[fd].offset = 0;
+        _ext2.iput(inode_idx);
+        // the last close gives the unused reserved blocks back
+        if (not is_open(inode_idx))
+            _ext2.discard_prealloc(inode_idx);
         return 0;
     }
     ssize_t read(int fd, void *buf, size_t count)
@@ -440,8 +806,9 @@ public:
             return -1;
         ext2_inode inode;
         _ext2.get_inode(_fd.inode_idx, inode);
-        inode.i_atime = time(NULL);
-        _ext2.write_inode(_fd.inode_idx, inode);
+        auto before = inode;
+        if (touch_atime(inode))
+            write_inode(_fd.inode_idx, inode, before);
         if (_fd.offset >= inode.i_size)
             return 0;
         size_t real_read_size = 0;
@@ -449,40 +816,45 @@ public:
             real_read_size = inode.i_size - _fd.offset;
         else
             real_read_size = count;
-        auto &&all_blocks = _ext2.get_inode_all_blocks(_fd.inode_idx);
-
-        auto start_block = _fd.offset / BLOCK_SIZE;
-        auto start_offset = _fd.offset % BLOCK_SIZE;
-        auto end_block = (_fd.offset + real_read_size) / BLOCK_SIZE;
-        auto end_offset = (_fd.offset + real_read_size) % BLOCK_SIZE;
-
-        if (start_block == end_block)
+        if (_ext2.is_inline_inode(inode))
         {
-            _ext2._disk.read_block(all_blocks[start_block], _buf);
-            memcpy(buf, _buf + start_offset, real_read_size);
+            memcpy(buf, _ext2.inline_data(inode) + _fd.offset, real_read_size);
+            _fd.offset += real_read_size;
+            return real_read_size;
         }
-        else
+        size_t pos = _fd.offset;
+        size_t end = _fd.offset + real_read_size;
+        size_t first = pos / BLOCK_SIZE;
+        auto &&blocks = _ext2.bmaps(_fd.inode_idx, first, (end - 1) / BLOCK_SIZE - first + 1);
+
+        while (pos < end)
         {
-            for (auto i = start_block; i <= end_block; i++)
+            size_t i = pos / BLOCK_SIZE;
+            size_t in_block = pos % BLOCK_SIZE;
+            size_t len = std::min(BLOCK_SIZE - in_block, end - pos);
+            if (i - first < blocks.size() and blocks[i - first] != EXT2M_I_BLOCK_SPARSE)
             {
-                _ext2._disk.read_block(all_blocks[i], _buf);
-                if (i == start_block)
-                {
-                    memcpy(buf, _buf + start_offset, BLOCK_SIZE - start_offset);
-                    buf = (uint8_t *)buf + BLOCK_SIZE - start_offset;
-                }
-                else if (i == end_block)
-                {
-                    memcpy(buf, _buf, end_offset);
-                }
+                if (_ext2.is_unwritten(inode, i))
+                    memset(buf, 0, len);
                 else
                 {
-                    memcpy(buf, _buf, BLOCK_SIZE);
-                    buf = (uint8_t *)buf + BLOCK_SIZE;
+                    _ext2._disk.read_block(blocks[i - first], _buf);
+                    memcpy(buf, _buf + in_block, len);
                 }
             }
+            else
+            {
+                // not allocated yet, the data is still in memory, or a hole
+                auto *page = delayed_page(_fd.inode_idx, i);
+                if (page == nullptr)
+                    memset(buf, 0, len);
+                else
+                    memcpy(buf, page + in_block, len);
+            }
+            buf = (uint8_t *)buf + len;
+            pos += len;
         }
-
+        _fd.offset += real_read_size;
         return real_read_size;
     }
     ssize_t write(int fd, const void *buf, uint32_t count)
@@ -498,66 +870,214 @@ public:
         auto offset = _fd.offset;
         ext2_inode inode;
         _ext2.get_inode(inode_idx, inode);
+        auto before = inode;
         inode.i_size = std::max(inode.i_size, offset + count);
-        inode.i_atime = time(NULL);
+        touch_atime(inode);
         inode.i_mtime = time(NULL);
-        _ext2.write_inode(inode_idx, inode);
 
-        auto &&all_blocks = _ext2.get_inode_all_blocks(inode_idx);
-
-        auto start_block = offset / BLOCK_SIZE;
-        auto start_offset = offset % BLOCK_SIZE;
-        auto end_block = (offset + count) / BLOCK_SIZE;
-        auto end_offset = (offset + count) % BLOCK_SIZE;
-        // TODO :SPARSE FILE SUPPORT
-
-        if (end_block >= all_blocks.size())
+        // a tiny file keeps its data in the inode until it outgrows i_block
+        bool is_inline = _ext2.is_inline_inode(inode);
+        if (not is_inline and _ext2.inline_data_enabled() and inode.i_size <= Ext2m::Ext2m::INLINE_DATA_MAX and
+            _delayed.count(inode_idx) == 0 and _ext2.get_block_count(inode_idx) == 0)
+        {
+            _ext2.set_inline(inode);
+            is_inline = true;
+        }
+        if (is_inline)
         {
-            int cnt = end_block - all_blocks.size() + 1;
-            while (cnt--)
+            if (inode.i_size <= Ext2m::Ext2m::INLINE_DATA_MAX)
             {
-                _ext2.add_block_to_inode(inode_idx);
+                memcpy(_ext2.inline_data(inode) + offset, buf, count);
+                _ext2.write_inode(inode_idx, inode);
+                _fd.offset += count;
+                return count;
             }
-            all_blocks = _ext2.get_inode_all_blocks(inode_idx);
+            uninline(inode_idx, inode);
         }
 
-        if (start_block == end_block)
+        size_t pos = offset;
+        size_t end = offset + count;
+        size_t first = pos / BLOCK_SIZE;
+        size_t last = (end - 1) / BLOCK_SIZE;
+        // the unwritten blocks written to start from zeros, those between the written mark and the range are zeroed on disk
+        uint64_t mark = _ext2.written_mark(inode);
+        if (last >= mark)
         {
-            _ext2._disk.read_block(all_blocks[start_block], _buf);
-            memcpy(_buf + start_offset, buf, count);
-            _ext2._disk.write_block(all_blocks[start_block], _buf);
+            if (first > mark)
+                zero_blocks(_ext2.bmaps(inode_idx, mark, first - mark));
+            _ext2.set_written_mark(inode, last + 1, _ext2.get_block_count(inode_idx));
         }
-        else
+        write_inode(inode_idx, inode, before);
+
+        auto &&blocks = _ext2.bmaps(_fd.inode_idx, first, last - first + 1);
+        while (pos < end)
         {
-            for (size_t i = start_block; i <= end_block; i++)
+            size_t i = pos / BLOCK_SIZE;
+            size_t in_block = pos % BLOCK_SIZE;
+            size_t len = std::min(BLOCK_SIZE - in_block, end - pos);
+            if (i - first < blocks.size() and blocks[i - first] != EXT2M_I_BLOCK_SPARSE)
             {
-                auto &&block = all_blocks[i];
-
-                if (i == start_block)
-                {
-                    _ext2._disk.read_block(block, _buf);
-                    memcpy(_buf + start_offset, buf, BLOCK_SIZE - start_offset);
-                    _ext2._disk.write_block(block, _buf);
-                    buf = (uint8_t *)(buf) + BLOCK_SIZE - start_offset;
-                }
-                else if (i == end_block)
-                {
-                    _ext2._disk.read_block(block, _buf);
-                    memcpy(_buf, buf, end_offset);
-                    _ext2._disk.write_block(block, _buf);
-                }
+                auto &&block = blocks[i - first];
+                if (i >= mark)
+                    memset(_buf, 0, BLOCK_SIZE);
                 else
-                {
                     _ext2._disk.read_block(block, _buf);
-                    memcpy(_buf, buf, BLOCK_SIZE);
-                    _ext2._disk.write_block(block, _buf);
-                    buf = (uint8_t *)(buf) + BLOCK_SIZE;
+                memcpy(_buf + in_block, buf, len);
+                _ext2._disk.write_block(block, _buf);
+            }
+            else
+            {
+                // delayed allocation : keep the data against its logical block until writeback, only the written blocks of a hole
+                // get one
+                auto &&page = _delayed[inode_idx][i];
+                if (page == nullptr)
+                {
+                    page.reset(new uint8_t[BLOCK_SIZE]);
+                    memset(page.get(), 0, BLOCK_SIZE);
+                    _delayed_blocks++;
                 }
+                memcpy(page.get() + in_block, buf, len);
             }
+            buf = (uint8_t *)(buf) + len;
+            pos += len;
         }
         _fd.offset += count;
+        if (_delayed_blocks * BLOCK_SIZE > DELAYED_ALLOC_LIMIT)
+            writeback_all();
         return count;
     }
+    /**
+     * @brief Reserve the blocks of [offset, offset + len) of a file, growing it if needed. The missing blocks are mapped in one
+     * allocator pass per run, contiguously when free space allows, so later writes to the range allocate nothing. The blocks added
+     * past the end of the file are left unwritten and read as zeros without being zeroed on disk, the holes filled inside the
+     * written part of the file are zeroed.
+     *
+     * @param fd
+     * @param offset
+     * @param len
+     * @return 0 on success, -1 for a bad fd, a fd not open for writing, a bad range, one ending past the 32-bit i_size or not
+     * enough free blocks for it (nothing is allocated then).
+     */
+    int fallocate(int fd, off_t offset, off_t len)
+    {
+        if (!check_fd(fd) or offset < 0 or len <= 0)
+            return -1;
+        if (len > UINT32_MAX or offset > UINT32_MAX - len)
+            return -1;
+        if (not check_writeable(_files[fd].flag))
+            return -1;
+        auto inode_idx = _files[fd].inode_idx;
+        uint64_t size = offset + len;
+        ext2_inode inode;
+        _ext2.get_inode(inode_idx, inode);
+        if (_ext2.is_inline_inode(inode) and size > Ext2m::Ext2m::INLINE_DATA_MAX)
+        {
+            auto last = Ext2m::ceil(size, BLOCK_SIZE);
+            if (_ext2.blocks_to_map(inode, last, 0, last) > _ext2.free_blocks_count())
+                return -1;
+            uninline(inode_idx, inode);
+            _ext2.write_inode(inode_idx, inode);
+        }
+        if (not _ext2.is_inline_inode(inode))
+        {
+            // the delayed blocks get theirs first, the range is then only mapped blocks and holes
+            writeback(inode_idx);
+            _ext2.get_inode(inode_idx, inode);
+            uint64_t first = offset / BLOCK_SIZE;
+            uint64_t last = Ext2m::ceil(size, BLOCK_SIZE);
+            uint64_t have = _ext2.get_block_count(inode_idx);
+            std::vector<uint32_t> blocks;
+            if (first < have)
+                blocks = _ext2.bmaps(inode_idx, first, std::min(last, have) - first);
+            // all of the range or nothing : the holes in it and the blocks past the end of the file must fit in the free blocks
+            uint64_t missing = std::count(blocks.begin(), blocks.end(), EXT2M_I_BLOCK_SPARSE);
+            if (last > have)
+                missing += last - std::max(first, have);
+            if (_ext2.blocks_to_map(inode, missing, first, last) > _ext2.free_blocks_count())
+                return -1;
+            if (last > have)
+            {
+                _ext2.set_written_mark(inode, std::min(have, _ext2.written_mark(inode)), last);
+                _ext2.write_inode(inode_idx, inode);
+            }
+            if (first < have)
+            {
+                for (size_t k = 0; k < blocks.size();)
+                {
+                    size_t n = 0;
+                    while (k + n < blocks.size() and blocks[k + n] == EXT2M_I_BLOCK_SPARSE)
+                        n++;
+                    if (n == 0)
+                    {
+                        k++;
+                        continue;
+                    }
+                    auto &&added = _ext2.add_blocks_to_inode(inode_idx, n, first + k);
+                    // only the blocks past the written mark may skip zeroing
+                    uint64_t mark = _ext2.written_mark(inode);
+                    if (first + k < mark)
+                        added.resize(std::min<uint64_t>(n, mark - (first + k)));
+                    else
+                        added.clear();
+                    zero_blocks(added);
+                    k += n;
+                }
+            }
+            // the blocks between the end of the file and the range stay holes
+            if (last > have)
+                _ext2.add_blocks_to_inode(inode_idx, last - std::max(first, have), std::max(first, have));
+            _ext2.get_inode(inode_idx, inode);
+        }
+        if (size > inode.i_size)
+            inode.i_size = size;
+        inode.i_ctime = time(NULL);
+        _ext2.write_inode(inode_idx, inode);
+        return 0;
+    }
+    /**
+     * @brief Write the delayed data of the file out, see writeback(), and the lazily updated timestamps.
+     *
+     * @param fd
+     * @return 0 on success, -1 for a bad fd.
+     */
+    int fsync(int fd)
+    {
+        if (!check_fd(fd))
+            return -1;
+        writeback(_files[fd].inode_idx);
+        _ext2.sync(true);
+        return 0;
+    }
+    /**
+     * @brief Set the size of an open file, see truncate_inode().
+     *
+     * @param fd
+     * @param length
+     * @return 0 on success, -1 for a bad fd, a fd not open for writing or a length negative or past the 32-bit i_size.
+     */
+    int ftruncate(int fd, off_t length)
+    {
+        if (!check_fd(fd) or length < 0 or length > UINT32_MAX)
+            return -1;
+        if (not check_writeable(_files[fd].flag))
+            return -1;
+        truncate_inode(_files[fd].inode_idx, length);
+        return 0;
+    }
+    int truncate(const char *path, off_t length)
+    {
+        return truncateat(AT_FDCWD, path, length);
+    }
+
+    int truncateat(int dd, const char *path, off_t length)
+    {
+        int fd = openat(dd, path, O_WRONLY);
+        if (fd == -1)
+            return -1;
+        auto ret = ftruncate(fd, length);
+        close(fd);
+        return ret;
+    }
     off_t lseek(int fd, off_t offset, int whence)
     {
         if (!check_fd(fd))
@@ -576,6 +1096,17 @@ public:
         case SEEK_END:
             _files[fd].offset = inode.i_size + offset;
             break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+        {
+            if (offset < 0 or offset >= inode.i_size)
+                return -1;
+            auto pos = seek_data_or_hole(inode_idx, inode, offset, whence == SEEK_DATA);
+            if (pos == -1)
+                return -1;
+            _files[fd].offset = pos;
+            break;
+        }
         default:
             return -1;
         }
@@ -601,8 +1132,23 @@ public:
     }
     int stat(const char *path, struct stat *buf)
     {
-        auto dir = to_absolute_path(path);
-        return stat_from_root(dir.c_str(), buf);
+        return fstatat(AT_FDCWD, path, buf);
+    }
+
+    /**
+     * @brief stat() relative to a directory handle, see openat(). An empty path is the directory itself.
+     *
+     * @param dd
+     * @param path
+     * @param buf
+     * @return int
+     */
+    int fstatat(int dd, const char *path, struct stat *buf)
+    {
+        auto dir = dir_of(dd);
+        if (dir == 0)
+            return -1;
+        return stat_at(dir, path, buf);
     }
 
     /**
@@ -630,25 +1176,136 @@ public:
 
     int mkdir(const char *path)
     {
-        auto dir = to_absolute_path(path);
-        return mkdir_from_root(dir.c_str());
+        return mkdirat(AT_FDCWD, path);
+    }
+
+    int mkdirat(int dd, const char *path)
+    {
+        auto dir = dir_of(dd);
+        if (dir == 0)
+            return -1;
+        return mkdir_at(dir, path);
+    }
+
+    /**
+     * @brief Open a directory stream, its entries are read one by one with readdir().
+     *
+     * @param path
+     * @return int the stream handle, -1 if the path is not a directory.
+     */
+    int opendir(const char *path)
+    {
+        return opendirat(AT_FDCWD, path);
+    }
+
+    /**
+     * @brief opendir() relative to a directory handle, see openat(). The new stream is a directory handle too, e.g. for a
+     * working directory.
+     *
+     * @param dd
+     * @param path
+     * @return int
+     */
+    int opendirat(int dd, const char *path)
+    {
+        auto dir = dir_of(dd);
+        struct stat st;
+        if (dir == 0 or stat_at(dir, path, &st) == -1 or not check_dir(st.st_mode))
+            return -1;
+        size_t ret = 0;
+        while (ret < _dirs.size() and _dirs[ret] != nullptr)
+            ret++;
+        if (ret == _dirs.size())
+            _dirs.emplace_back();
+        _dirs[ret].reset(new Ext2m::Ext2m::dir_iterator(_ext2, st.st_ino));
+        _ext2.iget(st.st_ino);
+        return ret;
     }
 
-    std::string ls(const char *path)
+    /**
+     * @brief Read the next entry of a directory stream, "." and ".." included.
+     *
+     * @param dd
+     * @param ent filled with the entry, its name points into the cached directory block and is valid until the next call.
+     * @return int 1 for an entry, 0 at the end of the directory, -1 if dd is not open.
+     */
+    int readdir(int dd, Ext2m::dirent_view &ent)
     {
-        auto dir = to_absolute_path(path);
-        return ls_from_root(dir.c_str());
+        if (not check_dd(dd))
+            return -1;
+        return _dirs[dd]->next(ent) ? 1 : 0;
+    }
+
+    /**
+     * @brief Read up to count entries of a directory stream with their attributes. The inodes of the batch are fetched in inode
+     * num order, each inode-table block once.
+     *
+     * @param dd
+     * @param out filled with the entries, in directory order.
+     * @param count
+     * @return ssize_t the number of entries read, 0 at the end of the directory, -1 if dd is not open.
+     */
+    ssize_t readdirplus(int dd, std::vector<dirent_plus> &out, size_t count)
+    {
+        if (not check_dd(dd))
+            return -1;
+        out.clear();
+        std::vector<uint32_t> nums;
+        Ext2m::dirent_view e;
+        while (out.size() < count and _dirs[dd]->next(e))
+        {
+            out.emplace_back();
+            out.back().name = e.str();
+            out.back().file_type = e.file_type;
+            nums.push_back(e.inode);
+        }
+        auto &&inodes = _ext2.get_inodes(nums);
+        for (size_t i = 0; i < out.size(); i++)
+            fill_stat(nums[i], inodes[i], &out[i].st);
+        return out.size();
+    }
+
+    int rewinddir(int dd)
+    {
+        if (not check_dd(dd))
+            return -1;
+        _dirs[dd]->rewind();
+        return 0;
+    }
+
+    int closedir(int dd)
+    {
+        if (not check_dd(dd))
+            return -1;
+        auto inode_idx = _dirs[dd]->inode_num();
+        _dirs[dd].reset();
+        _ext2.iput(inode_idx);
+        return 0;
     }
 
     int rmdir(const char *path)
     {
-        auto dir = to_absolute_path(path);
-        return rmdir_from_root(dir.c_str());
+        return unlinkat(AT_FDCWD, path, AT_REMOVEDIR);
     }
     int unlink(const char *path)
     {
-        auto dir = to_absolute_path(path);
-        return unlink_from_root(dir.c_str());
+        return unlinkat(AT_FDCWD, path, 0);
+    }
+
+    /**
+     * @brief unlink() or rmdir() relative to a directory handle, see openat().
+     *
+     * @param dd
+     * @param path
+     * @param flags AT_REMOVEDIR to remove a directory.
+     * @return int
+     */
+    int unlinkat(int dd, const char *path, int flags)
+    {
+        auto dir = dir_of(dd);
+        if (dir == 0)
+            return -1;
+        return (flags & AT_REMOVEDIR) ? rmdir_at(dir, path) : unlink_at(dir, path);
     }
     int delet(const char *path)
     {
@@ -656,21 +1313,56 @@ public:
     }
     int create(const char *path)
     {
-        auto dir = to_absolute_path(path);
-        return create_file_from_root(dir.c_str());
+        return create_file_at(ROOT_INODE, path);
     }
     int touch(const char *path)
     {
         return create(path);
     }
+
+    /**
+     * @brief Create many files or directories in one directory at once : their inodes are allocated together and their
+     * inode-table blocks written once, their entries are packed in the directory blocks one after another. Either all of them are
+     * created or none.
+     *
+     * @param dir_path the directory they are created in.
+     * @param names
+     * @param is_dir
+     * @return int -1 if the directory does not exist, a name is not valid, repeated or exists already, there are more than
+     * CREATE_MANY_MAX names, or the disk is full.
+     */
+    int create_many(const char *dir_path, const std::vector<std::string> &names, bool is_dir = false)
+    {
+        return create_manyat(AT_FDCWD, dir_path, names, is_dir);
+    }
+
+    int create_manyat(int dd, const char *dir_path, const std::vector<std::string> &names, bool is_dir = false)
+    {
+        auto dir = dir_of(dd);
+        if (dir == 0)
+            return -1;
+        return create_many_at(dir, dir_path, names, is_dir);
+    }
     int mv(const char *oldpath, const char *newpath)
     {
-        auto old = to_absolute_path(oldpath);
-        auto newp = to_absolute_path(newpath);
-        return mv_from_root(old.c_str(), newp.c_str());
+        return renameat(AT_FDCWD, oldpath, AT_FDCWD, newpath);
+    }
+
+    int renameat(int olddd, const char *oldpath, int newdd, const char *newpath)
+    {
+        auto old_dir = dir_of(olddd), new_dir = dir_of(newdd);
+        if (old_dir == 0 or new_dir == 0)
+            return -1;
+        return mv_at(old_dir, oldpath, new_dir, newpath);
     }
     void sync()
     {
+        writeback_all();
+        _ext2.compact_dirs([this](uint32_t inode_idx) { return not is_opendir(inode_idx); });
+        // directories are never opened, drop their windows here
+        _ext2.discard_prealloc_if([this](uint32_t inode_idx) { return not is_open(inode_idx); });
+        // zero a bit more of the inode tables left by a lazy format
+        _ext2.lazy_init(256);
         _ext2.sync();
     }
 
@@ -683,14 +1375,16 @@ public:
         // home
         std::cout << path << std::endl;
 
-        auto &&paths = split(path.c_str(), "/");
+        path_iterator it(path.c_str());
+        const char *name;
+        size_t len;
         uint32_t inode_idx = ROOT_INODE;
         std::unordered_map<int, int> fa;
         fa[ROOT_INODE] = ROOT_INODE;
         std::vector<std::string> real_paths;
-        for (auto &&i : paths)
+        while (it.next(name, len))
         {
-            auto idx = find_dir_from_inode(inode_idx, i, true);
+            auto idx = find_dir_from_inode(inode_idx, name, len, true);
             if (idx == -1)
                 return "";
             if (idx != inode_idx) // not ./
@@ -699,7 +1393,7 @@ public:
                 if (pos == fa.end())
                 {
                     fa[idx] = inode_idx;
-                    real_paths.push_back(i);
+                    real_paths.emplace_back(name, len);
                 }
                 else
                 {